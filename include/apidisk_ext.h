@@ -0,0 +1,375 @@
+/*****************************************************************************
+ *  Instituto de Informatica - Universidade Federal do Rio Grande do Sul     *
+ *  INF01142 - Sistemas Operacionais I N                                     *
+ *  Task 2 File System (T2FS) 2019/1                                         *
+ *                                                                           *
+ *  Authors: Yuri Jaschek                                                    *
+ *           Giovane Fonseca                                                 *
+ *           Humberto Lentz                                                  *
+ *           Matheus F. Kovaleski                                            *
+ *                                                                           *
+ *****************************************************************************/
+
+/*
+ *   Extensions to the disk API (apidisk.h), implemented in lib/apidisk*.c
+ *
+ *   The sectors are served by a backend (struct disk_ops), which can be
+ *       changed at runtime with set_disk_ops. The default backend is chosen
+ *       at build time by the root Makefile:
+ *       make all      -> the professor's apidisk.o (APIDISK_LEGACY)
+ *       make all64    -> pread/pwrite on "t2fs_disk.dat" (disk_file_ops)
+ *       make all-mmap -> "t2fs_disk.dat" mapped in memory (disk_mmap_ops)
+ */
+
+#ifndef APIDISK_EXT_H
+#define APIDISK_EXT_H
+
+#include <sys/uio.h>
+
+#define DISK_FILENAME "t2fs_disk.dat"
+#define DISK_ALIGN    4096 // Alignment of buffers and transfers for O_DIRECT
+
+// Flags for set_disk_flags
+#define DISK_DIRECT 0x1 // Bypass the host page cache (O_DIRECT), if possible
+
+#define DISK_HIST_BUCKETS 32 // Latency histogram buckets, see disk_io_counters
+
+
+/***************************
+ *  Structure definitions  *
+ ***************************/
+
+// One request in a batch of disk requests, see submit_sectors
+struct disk_request
+{
+    unsigned int sector;   // First sector to be transferred
+    unsigned int count;    // Number of sectors to be transferred
+    unsigned char *buffer; // Data to be transferred (count * SECTOR_SIZE)
+    int write;             // If it's a read (0) or a write (non-zero)
+    int result;            // Set on completion: 0 on success
+};
+
+// I/O counters of one kind of request (read or write)
+// All fields are unsigned long long, so they can be summed as an array
+struct disk_io_counters
+{
+    unsigned long long requests;   // Number of requests
+    unsigned long long sectors;    // Sectors transferred
+    unsigned long long bytes;      // Bytes transferred
+    unsigned long long sequential; // Requests starting where the previous one
+                                   //   (of the same kind and thread) ended
+    unsigned long long random;     // The other requests
+    unsigned long long errors;     // Requests that failed
+    unsigned long long time_ns;    // Time spent in the requests, in ns
+    // Number of requests by latency: bucket i counts the ones that took
+    //   [2^(i-1), 2^i) ns (bucket 0: < 1 ns). The last one also counts slower
+    unsigned long long hist[DISK_HIST_BUCKETS];
+};
+
+// Sector I/O statistics, see t2fs_io_stats
+struct disk_io_stats
+{
+    struct disk_io_counters read;
+    struct disk_io_counters write;
+};
+
+// Device simulated by disk_sim_start, which charges each request's time on a
+//   virtual clock. Costs in ns; bytes_per_sec = 0 makes transfers free
+struct disk_sim_model
+{
+    int ssd; // If the device is an SSD (non-zero) or an HDD (0)
+    // HDD: a request not starting at the sector after the previous one costs
+    //   a seek plus half a rotation. The seek grows with the square root of
+    //   the distance, from seek_min_ns (1 sector) to seek_max_ns (all disk)
+    unsigned long long seek_min_ns;
+    unsigned long long seek_max_ns;
+    unsigned int rpm;
+    // SSD: each request costs a fixed latency, and up to 'channels' requests
+    //   of a batch (see submit_sectors) are served in parallel
+    unsigned long long read_ns;
+    unsigned long long write_ns;
+    unsigned int channels;
+    // Both: transfer rate
+    unsigned long long bytes_per_sec;
+};
+
+// Sector backend. Sectors are numbered from 0, each SECTOR_SIZE bytes long
+// All functions return 0 on success and non-zero on error
+struct disk_ops
+{
+    const char *name; // Name of the backend, for information purposes
+    int (*open)(int flags); // Get the disk ready to be used (DISK_* flags)
+    int (*close)(void);     // Release the disk (only if open succeeded)
+    int (*flush)(void);     // Make the previous writes durable
+    // Transfer 'count' consecutive sectors from 'sector' to/from 'buffer'
+    int (*read)(unsigned int sector, unsigned int count,
+                unsigned char *buffer);
+    int (*write)(unsigned int sector, unsigned int count,
+                 unsigned char *buffer);
+    // Same, scattered in memory. Optional: if NULL, read/write are used
+    int (*readv)(unsigned int sector, const struct iovec *iov, int iovcnt);
+    int (*writev)(unsigned int sector, const struct iovec *iov, int iovcnt);
+    // Carry out many requests at once, returning how many of them failed
+    // Optional: if NULL, the requests are done one by one with read/write
+    int (*submit)(struct disk_request *reqs, int nreqs);
+    // Free the storage of sectors, which then read back as zeros
+    // Optional: if NULL, discard_sectors fails
+    int (*discard)(unsigned int sector, unsigned int count);
+};
+
+extern const struct disk_ops disk_file_ops; // pread/pwrite (lib/apidisk.c)
+extern const struct disk_ops disk_mmap_ops; // mmap (lib/apidisk_mmap.c)
+extern const struct disk_ops disk_ram_ops;  // memory (lib/apidisk_ram.c)
+
+extern const struct disk_sim_model disk_sim_hdd; // 7200 rpm, 150 MB/s
+extern const struct disk_sim_model disk_sim_ssd; // 8 channels, 500 MB/s
+
+
+/***************************
+ *  Function declarations  *
+ ***************************/
+
+/*-----------------------------------------------------------------------------
+Funct:  Change the backend that serves the disk sectors.
+        The disk opened with the previous backend is closed first.
+Input:  ops -> The new backend
+Return: On success, 0 is returned. Otherwise, a non-zero value is returned.
+-----------------------------------------------------------------------------*/
+int set_disk_ops (const struct disk_ops *ops);
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Get the backend that serves the disk sectors.
+Return: The backend being used.
+-----------------------------------------------------------------------------*/
+const struct disk_ops *get_disk_ops (void);
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Set the flags the disk is opened with. If they change and the disk is
+            opened, it's closed, to be opened again with the new flags.
+        With DISK_DIRECT, the file backend opens "t2fs_disk.dat" with O_DIRECT
+            (if the host file system supports it), so the data isn't cached
+            twice. Requests with buffers, sizes or positions that aren't
+            multiples of DISK_ALIGN are then copied through an aligned buffer.
+        Backends ignore the flags they don't support.
+Input:  flags -> Bitwise OR of DISK_* flags (0 for none)
+Return: On success, 0 is returned. Otherwise, a non-zero value is returned.
+-----------------------------------------------------------------------------*/
+int set_disk_flags (int flags);
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Open the virtual disk, keeping it open until close_disk is called.
+        Calling it while the disk is already opened does nothing.
+        read_sector and write_sector also open the disk on demand, so calling
+            this function is only needed to catch errors early.
+Return: On success, 0 is returned. Otherwise, a non-zero value is returned.
+-----------------------------------------------------------------------------*/
+int open_disk (void);
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Close the virtual disk, if it's opened.
+        Any sector operation after this will open the disk again.
+Return: On success, 0 is returned. Otherwise, a non-zero value is returned.
+-----------------------------------------------------------------------------*/
+int close_disk (void);
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Make all sectors written so far durable in "t2fs_disk.dat" (fdatasync
+            for the file backend, msync for the mmap backend).
+Return: On success, 0 is returned. Otherwise, a non-zero value is returned.
+-----------------------------------------------------------------------------*/
+int flush_disk (void);
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Read consecutive sectors of the disk with a single request.
+Input:  sector -> First sector to be read, starting from 0
+        count  -> Number of sectors to be read
+        buffer -> Where to store the data read (count * SECTOR_SIZE bytes)
+Return: On success, 0 is returned. Otherwise, a non-zero value is returned.
+-----------------------------------------------------------------------------*/
+int read_sectors (unsigned int sector, unsigned int count,
+                  unsigned char *buffer);
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Write consecutive sectors of the disk with a single request.
+Input:  sector -> First sector to be written, starting from 0
+        count  -> Number of sectors to be written
+        buffer -> Where the data is (count * SECTOR_SIZE bytes)
+Return: On success, 0 is returned. Otherwise, a non-zero value is returned.
+-----------------------------------------------------------------------------*/
+int write_sectors (unsigned int sector, unsigned int count,
+                   unsigned char *buffer);
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Read consecutive sectors of the disk into scattered buffers, with a
+            single request.
+        Every iov_len must be a multiple of SECTOR_SIZE.
+Input:  sector -> First sector to be read, starting from 0
+        iov    -> Buffers to be filled, in order
+        iovcnt -> Number of buffers in iov
+Return: On success, 0 is returned. Otherwise, a non-zero value is returned.
+-----------------------------------------------------------------------------*/
+int readv_sectors (unsigned int sector, const struct iovec *iov, int iovcnt);
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Write scattered buffers to consecutive sectors of the disk, with a
+            single request.
+        Every iov_len must be a multiple of SECTOR_SIZE.
+Input:  sector -> First sector to be written, starting from 0
+        iov    -> Buffers to be written, in order
+        iovcnt -> Number of buffers in iov
+Return: On success, 0 is returned. Otherwise, a non-zero value is returned.
+-----------------------------------------------------------------------------*/
+int writev_sectors (unsigned int sector, const struct iovec *iov, int iovcnt);
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Carry out a batch of independent disk requests, returning when all of
+            them are complete. The result of each one is set in its 'result'.
+        With the file backend, the whole batch is submitted to the kernel at
+            once through io_uring (when available), and the completions are
+            reaped together. Otherwise, the requests are done one by one.
+        Requests in the same batch must not overlap if any of them writes.
+Input:  reqs  -> The requests
+        nreqs -> Number of requests in reqs
+Return: On success (all requests succeeded), 0 is returned.
+        Otherwise, a non-zero value is returned.
+-----------------------------------------------------------------------------*/
+int submit_sectors (struct disk_request *reqs, int nreqs);
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Tell the disk the given sectors aren't used anymore, so the storage
+            behind them can be freed. Afterwards, they read back as zeros.
+        The file backend punches a hole in "t2fs_disk.dat" (fallocate), which
+            shrinks on the host. The mmap and RAM backends give whole pages
+            back to the system and zero the rest.
+Input:  sector -> First sector to be discarded, starting from 0
+        count  -> Number of sectors to be discarded
+Return: On success, 0 is returned. Otherwise (including when the backend
+            can't discard), a non-zero value is returned.
+-----------------------------------------------------------------------------*/
+int discard_sectors (unsigned int sector, unsigned int count);
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Get the statistics of all sector requests since the start of the
+            process or the last t2fs_io_stats_reset, from all threads.
+        Every request through this API is counted: the ones of T2FS and the
+            ones made directly. Each request of a submit_sectors batch is
+            charged the time of the whole batch.
+        Each thread updates its own counters, without locks, so the values
+            may be slightly behind if other threads are doing I/O meanwhile.
+Input:  stats -> Where to store the statistics
+-----------------------------------------------------------------------------*/
+void t2fs_io_stats (struct disk_io_stats *stats);
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Reset the statistics returned by t2fs_io_stats to zero.
+-----------------------------------------------------------------------------*/
+void t2fs_io_stats_reset (void);
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Create a RAM disk, living only in this process' memory, and make it
+            the backend. No file is involved unless ramdisk_save is called.
+        The memory is backed by huge pages if the system has them reserved.
+        Must be called before any T2FS function, as the MBR is read only once.
+Input:  num_sectors -> Size of the disk, in sectors (at least 2)
+        mbr         -> Contents of the MBR (SECTOR_SIZE bytes). If NULL, an
+                           MBR with a single partition taking all the other
+                           sectors is written
+Return: On success, 0 is returned. Otherwise, a non-zero value is returned.
+-----------------------------------------------------------------------------*/
+int ramdisk_create (unsigned int num_sectors, const unsigned char *mbr);
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Create a RAM disk with a copy of a disk file, and make it the backend.
+        Must be called before any T2FS function, as the MBR is read only once.
+Input:  filename -> The disk file (NULL for "t2fs_disk.dat")
+Return: On success, 0 is returned. Otherwise, a non-zero value is returned.
+-----------------------------------------------------------------------------*/
+int ramdisk_load (const char *filename);
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Save the contents of the RAM disk to a disk file, which is replaced.
+Input:  filename -> The disk file (NULL for "t2fs_disk.dat")
+Return: On success, 0 is returned. Otherwise, a non-zero value is returned.
+-----------------------------------------------------------------------------*/
+int ramdisk_save (const char *filename);
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Free the memory of the RAM disk, discarding its contents.
+        The RAM backend must not be in use anymore (see set_disk_ops).
+-----------------------------------------------------------------------------*/
+void ramdisk_destroy (void);
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Simulate a device on top of the current backend, which still stores
+            the data. Each request is charged the time the simulated device
+            would take on a virtual clock (see disk_sim_time), without any
+            real waiting, so results are the same on every run. Meanwhile,
+            T2FS warms the cache at mount in the caller's thread, not in the
+            background; the flusher thread (see t2fs_flusher_start), if
+            started, still makes the times depend on its timing.
+        If the simulation is already started, only the model is changed.
+Input:  model       -> The device (e.g. &disk_sim_hdd or &disk_sim_ssd)
+        num_sectors -> Size of the device, in sectors (for the HDD seeks)
+Return: On success, 0 is returned. Otherwise, a non-zero value is returned.
+-----------------------------------------------------------------------------*/
+int disk_sim_start (const struct disk_sim_model *model,
+                    unsigned int num_sectors);
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Stop the simulation, giving the disk back to the wrapped backend.
+Return: On success, 0 is returned. Otherwise, a non-zero value is returned.
+-----------------------------------------------------------------------------*/
+int disk_sim_stop (void);
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Check if a device is being simulated (see disk_sim_start).
+Return: If so, a non-zero value is returned. Otherwise, 0 is returned.
+-----------------------------------------------------------------------------*/
+int disk_sim_active (void);
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Get the virtual clock of the simulated device.
+Return: Time charged since the simulation started or was reset, in ns.
+-----------------------------------------------------------------------------*/
+unsigned long long disk_sim_time (void);
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Reset the virtual clock to zero and put the HDD head at sector 0.
+-----------------------------------------------------------------------------*/
+void disk_sim_reset (void);
+
+
+/********************************************
+ *  Used between backends (lib/apidisk*.c)  *
+ ********************************************/
+
+// io_uring engine (lib/apidisk_uring.c), carrying out requests on the given
+//   file descriptor. Returns how many requests failed, or -1 if io_uring is
+//   unavailable, in which case nothing has been done
+int uring_submit (int fd, struct disk_request *reqs, int nreqs);
+void uring_release (void); // Release the ring, to be set up again on demand
+
+
+#endif // APIDISK_EXT_H
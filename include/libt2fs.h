@@ -39,14 +39,32 @@
 
 // Changeable
 #define T2FS_USE_CACHE    1 // 0 = false; 1 = true
-#define T2FS_SIGNATURE    "os sisopeiros" // Magic string in the superblock
+#define T2FS_CACHE_SIZE   (256*1024) // Initial, see cache2_config in t2fs.h
+#define T2FS_CACHE_META   0 // Initial bytes of the cache only for metadata
+#define T2FS_CACHE_POLICY CACHE_POLICY_2Q // Initial, see enum cache_policy
+#define T2FS_PIN_SIZE     (64*1024) // Max bytes of the cache pinned (metadata)
+#define T2FS_FLUSHER      0 // 1 = start the flusher thread (see flusher.c)
+#define T2FS_DIRTY_AGE    5000 // Max ms data stays dirty, with the flusher
+#define T2FS_DIRTY_RATIO  10 // % of the cache dirty that wakes the flusher
+#define T2FS_DIRTY_LIMIT  50 // % of the cache dirty that throttles writers
+#define T2FS_WARMUP       1 // 1 = warm the cache at mount (see warmup.c)
+#define T2FS_WARM_SECTORS 8 // Sectors for the warm list, when formatting
+#define T2FS_DIRECT_IO    0 // 1 = bypass the host page cache (O_DIRECT)
+#define T2FS_SIGNATURE    "os sisopeiros2" // Magic string in the superblock
 #define NUM_DIRECT_PTR    3 // Number of direct block pointers in inode
 #define NUM_INDIRECT_LVL  3 // 0 not allowed. 1 = singly; 2 = doubly; etc
 #define INODES_SECTOR_PCT 1.0 // % of sectors reserved for inodes
+#define T2FS_MAX_BATCH    64 // Max number of blocks submitted to disk at once
+#define T2FS_READAHEAD    32 // Max number of blocks read ahead (0 = none)
+#define T2FS_QUEUE_SIZE   256 // Max number of sector writes held in the queue
+#define T2FS_POOL_SIZE    (32*1024) // Max bytes of free buffers kept for reuse
+#define T2FS_DISCARD_MIN  16 // Min sectors freed together to be discarded
+#define T2FS_DISCARD_SIZE 64 // Max number of extents waiting to be discarded
 
 // Unchangeable / fixed
 #define ROOT_INODE       1U // Number of the root directory inode (must be 1)
 #define NUM_INODE_PTR    (NUM_DIRECT_PTR + NUM_INDIRECT_LVL) // Dir + indir ptr
+#define T2FS_SIGNATURE_V1 "os sisopeiros" // Old bitmap layout (see bitmap.c)
 
 typedef uint8_t byte_t;
 
@@ -60,6 +78,13 @@ typedef uint16_t u16;
 typedef uint32_t u32;
 typedef uint64_t u64;
 
+// Replacement policies of the cache (see cache.c)
+enum cache_policy
+{
+    CACHE_POLICY_LRU = 0, // Least recently used
+    CACHE_POLICY_2Q,      // Scan resistant: blocks used once are evicted first
+};
+
 
 /***************************
  *  Structure definitions  *
@@ -101,6 +126,12 @@ struct t2fs_superblock
     u32  ib_offset;         // Sector offset of the inodes bitmap
     u32  bb_offset;         // Sector offset of the blocks bitmap
     u32  blocks_offset;     // Sector offset of the logical blocks
+    u32  wl_offset;         // Sector offset of the warm list (0 = none)
+    u32  wl_sectors;        // Number of sectors of the warm list
+    u32  inode_rotor;       // Where the search for a free inode starts
+    u32  block_rotor;       // Where the search for a free block starts
+    u32  free_inodes;       // Number of inodes not being used
+    u32  free_blocks;       // Number of logical data blocks not being used
 };
 
 // Index node, which stores information about files
@@ -121,8 +152,34 @@ struct t2fs_record
     u32  inode; // Inode with the file's information (0 means unused entry)
 };
 
+// Entry of the warm list: what was cached at the last unmount (see warmup.c)
+struct t2fs_warm_entry
+{
+    u32 sector;      // First sector, relative to the partition (0 = list end)
+    u8  kind;        // What the data is, according to enum cache_kind
+    u8  reserved[3]; // Reserved (for alignment)
+};
+
 #pragma pack(pop)
 
+// Counters of the cache, reported through CACHESTAT2
+struct cache_counters
+{
+    u64 hits;       // Lookups of sectors found in the cache
+    u64 misses;     // Lookups of sectors not found in the cache
+    u64 ghost_hits; // Misses of entries evicted recently, remembered by 2Q
+    u64 evictions;  // Entries evicted to make room for others
+    u64 writebacks; // Dirty entries put in the write queue
+};
+
+// Block held by t2fs_get_block, until released with t2fs_put_block
+struct block_handle
+{
+    byte_t *data;              // Contents of the block (in the cache itself)
+    u32 block;                 // The block, relative to the partition
+    struct cache_entry *entry; // Its cache entry (NULL if data is a copy)
+};
+
 // File descriptor (of opened files)
 struct t2fs_descriptor
 {
@@ -130,6 +187,10 @@ struct t2fs_descriptor
     u8 type;      // Type of the file opened
     u32 curr_pos; // Byte offset from the beginning of the file
     u32 inode;    // The inode that corresponds to the opened file
+    u32 ra_pos;    // Where the next read starts, if reading sequentially
+    u32 ra_next;   // Index of the next block of the file not read ahead yet
+    u32 ra_window; // Number of blocks to read ahead (0 = not sequential)
+    bool pinned;   // If its inode was pinned when opened (see get_new_desc)
 };
 
 // Path information for a file
@@ -151,6 +212,7 @@ struct t2fs_path
 // allocation.c
 int read_inode(u32 inode, struct t2fs_inode *data);
 int write_inode(u32 inode, struct t2fs_inode *data);
+int pin_inode(u32 inode, bool pin);
 u32 use_new_inode(u8 type);
 u32 allocate_new_block(u32 inode);
 int deallocate_blocks(u32 inode, int count);
@@ -158,28 +220,78 @@ int inc_hl_count(u32 inode);
 int dec_hl_count(u32 inode);
 int iterate_inode_blocks(u32 inode, int (*fn)(u32, va_list), ...);
 
+// bitmap.c
+int t2fs_bitmap_load(bool old_layout);
+void t2fs_bitmap_release(void);
+int t2fs_bitmap_get(u32 number, bool inode);
+int t2fs_bitmap_set(u32 number, bool inode, bool used);
+u32 t2fs_bitmap_find(bool inode);
+int t2fs_bitmap_flush(void);
+void t2fs_bitmap_to_superblock(void);
+
 // cache.c
 int t2fs_read_sector(byte_t *data, u32 sector, int offset, int size);
 int t2fs_write_sector(byte_t *data, u32 sector, int offset, int size);
-int t2fs_read_block(byte_t *data, u32 block);
-int t2fs_write_block(byte_t *data, u32 block);
+int t2fs_read_block(byte_t *data, u32 block, u8 kind);
+int t2fs_write_block(byte_t *data, u32 block, u8 kind);
+int t2fs_get_block(struct block_handle *h, u32 block, u8 kind, bool zero);
+int t2fs_put_block(struct block_handle *h, bool dirty);
+void t2fs_prefetch_blocks(u32 *blocks, int count);
+int t2fs_pin_sector(u32 sector, bool pin);
+int t2fs_pin_block(u32 block, bool pin, u8 kind);
+byte_t *t2fs_alloc_buffer(u32 size);
+void t2fs_free_buffer(byte_t *buffer, u32 size);
+int t2fs_cache_writeback(u64 age_ns, u32 max_dirty);
+int t2fs_cache_flush(void);
+u32 t2fs_cache_dirty(void);
+void t2fs_cache_invalidate(void);
+int t2fs_cache_policy(int new_policy);
+u32 t2fs_cache_capacity(void);
+u32 t2fs_cache_data_capacity(void);
+void t2fs_cache_warm(struct t2fs_warm_entry *list, int count);
+u32 t2fs_cache_hot(struct t2fs_warm_entry *list, u32 max);
+void t2fs_cache_reset_counters(void);
+void t2fs_cache_lock(void);
+void t2fs_cache_unlock(void);
+
+// flusher.c (t2fs_flusher_start and t2fs_flusher_stop are in t2fs.h)
+void t2fs_flusher_throttle(void);
+
+// warmup.c
+int t2fs_warmup_save(void);
+int t2fs_warmup_start(void);
+void t2fs_warmup_stop(void);
 
 // init.c
-int init_format(int sectors_per_block, int partition);
+int init_format(int sectors_per_block, int partition, bool sparse);
 int init_t2fs(int partition);
+int init_write_superblock(void);
+int init_unmount(void);
 
 // opened.c
 struct t2fs_descriptor *get_new_desc(u32 inode, u8 type);
 struct t2fs_descriptor *find_desc(int fd);
 void release_desc(struct t2fs_descriptor *fd);
 void close_all_inode(u32 inode);
+void close_all_desc(void);
 void adjust_pointer_all(u32 inode, u32 limit);
+void t2fs_readahead(struct t2fs_descriptor *fd, u32 size);
 int t2fs_rw_data(byte_t *buffer, u32 inode, u32 curr_pos, u32 size, bool wr);
 
 // path.c
 struct t2fs_path get_path_info(char *filepath, bool resolve);
 void reverse_string(char *str);
 
+// queue.c
+int t2fs_queue_write(u32 sector, u32 count, byte_t *data);
+u32 t2fs_queue_overlay(u32 sector, u32 count, byte_t *data);
+int t2fs_queue_read(u32 sector, u32 count, byte_t *data);
+void t2fs_queue_cancel(u32 sector, u32 count);
+void t2fs_queue_discard(u32 sector, u32 count);
+void t2fs_queue_reuse(u32 sector, u32 count);
+void t2fs_queue_forget(void);
+int t2fs_queue_flush(void);
+
 // structure.c
 u32 get_inode_by_name(u32 dir_inode, char *name);
 int get_name_by_inode(u32 dir_inode, char *name, u32 inode);
@@ -201,8 +313,6 @@ void print_path(struct t2fs_path *path_info);
 
 // All these variables are defined in t2fs.c
 extern struct t2fs_superblock superblock; // To hold management information
-extern byte_t *block_buffer; // To read data blocks from disk
-extern u32 *idx_block_buffer[NUM_INDIRECT_LVL]; // For index blocks
 extern u32 cwd_inode; // Inode number of the current working directory
 
 
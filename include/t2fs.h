@@ -32,6 +32,34 @@ typedef struct
     uint32_t fileSize; // Size of the file, in bytes
 } DIRENT2;
 
+// Statistics of the cache, read with t2fs_cache_stats
+typedef struct
+{
+    uint64_t hits;       // Lookups of sectors found in the cache
+    uint64_t misses;     // Lookups of sectors not found in the cache
+    uint64_t ghost_hits; // Misses of entries evicted recently, remembered
+    uint64_t evictions;  // Entries evicted to make room for others
+    uint64_t writebacks; // Dirty entries written to disk
+    uint32_t entries;     // Entries with data in the cache
+    uint32_t dirty;       // Entries not written to disk yet
+    uint32_t dirty_bytes; // Bytes of data of the dirty entries
+    uint32_t pinned_bytes; // Bytes of data of the pinned entries
+    uint32_t capacity;    // Max bytes of data in the cache
+    uint32_t meta_reserve; // Bytes of the capacity only for metadata
+    uint32_t kind_entries[CACHE_NUM_KINDS]; // Entries of each enum cache_kind
+    uint32_t kind_bytes[CACHE_NUM_KINDS];   // Bytes of each enum cache_kind
+} CACHESTAT2;
+
+// Usage of the partition, read with statfs2
+typedef struct
+{
+    uint32_t block_size;   // Size of a logical block, in bytes
+    uint32_t total_blocks; // Logical blocks of the partition
+    uint32_t free_blocks;  // Logical blocks not being used
+    uint32_t total_inodes; // Inodes (files) the partition can have
+    uint32_t free_inodes;  // Inodes not being used
+} STATFS2;
+
 
 /**********************************
  *  Unused professor definitions  *
@@ -103,6 +131,18 @@ Return: On success, 0 is returned. Otherwise, a non-zero value is returned.
 int format2 (int sectors_per_block);
 
 
+/*-----------------------------------------------------------------------------
+Funct:  Same as format2, but the whole partition is discarded first, so the
+            empty parts of 't2fs_disk.dat' take no space on the host (sparse
+            file). If the disk can't discard, it's the same as format2.
+
+Input:  sectors_per_block -> Size of data block, in disk sectors
+
+Return: On success, 0 is returned. Otherwise, a non-zero value is returned.
+-----------------------------------------------------------------------------*/
+int format2_sparse (int sectors_per_block);
+
+
 /*-----------------------------------------------------------------------------
 Funct:  Create a new regular file, given its path.
         If the path is invalid, it's an error.
@@ -356,4 +396,103 @@ Return: On success, 0 is returned. Otherwise, a non-zero value is returned.
 int hardln2 (char *linkpath, char *pointpath);
 
 
+/*-----------------------------------------------------------------------------
+Funct:  Write to disk all data written so far that is still in memory.
+        Writes are kept in the cache and written back later (when evicted,
+            when this function or umount2 is called, or when the process
+            exits), in ascending sector order.
+        When this function returns, the data is also durable on the host
+            (see flush_disk in apidisk_ext.h).
+
+Return: On success, 0 is returned. Otherwise, a non-zero value is returned.
+-----------------------------------------------------------------------------*/
+int sync2 (void);
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Write everything to disk (see sync2), close all opened files and
+            directories, and release the disk.
+        Any T2FS function called afterwards mounts the partition again.
+
+Return: On success, 0 is returned. Otherwise, a non-zero value is returned.
+-----------------------------------------------------------------------------*/
+int umount2 (void);
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Fill the structure with the number of free blocks and inodes of the
+            partition, and its totals. It takes constant time: the counts are
+            kept along with the bitmaps.
+        Index blocks are taken from the free blocks as well, so a file needs
+            a little more than its size in blocks.
+
+Input:  stats -> Structure to be filled
+
+Return: On success, 0 is returned. Otherwise, a non-zero value is returned.
+-----------------------------------------------------------------------------*/
+int statfs2 (STATFS2 *stats);
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Fill the statistics structure with the state of the cache: counters
+            since the start (or the last reset), and what is in it now, by
+            kind of data.
+        Counters only grow, so the difference between two calls tells what
+            happened in between.
+
+Input:  stats -> Statistics structure to be filled
+
+Return: On success, 0 is returned. Otherwise, a non-zero value is returned.
+-----------------------------------------------------------------------------*/
+int t2fs_cache_stats (CACHESTAT2 *stats);
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Change how much memory the cache of disk data may use, at any time.
+        Part of it can be reserved for metadata (directories, index blocks
+            and inodes): the data of regular files never takes that
+            part, so reading or writing large files doesn't evict the
+            metadata beyond it.
+        If the cache shrinks, data is evicted (and written to disk, if not yet)
+            until it fits. Part of it can't be evicted (at most a quarter of
+            the capacity), so if that part doesn't fit in a quarter of the new
+            capacity, it's an error.
+        The initial values are T2FS_CACHE_SIZE and T2FS_CACHE_META.
+
+Input:  capacity  -> Max bytes of disk data kept in the cache
+        meta_size -> Bytes of the capacity reserved for metadata (not more than
+                     capacity)
+
+Return: On success, 0 is returned. Otherwise, a non-zero value is returned.
+-----------------------------------------------------------------------------*/
+int cache2_config (uint32_t capacity, uint32_t meta_size);
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Start a background thread that writes dirty cached data to disk when
+            it has been dirty for too long, or when too much of the cache is
+            dirty. Writers past a limit write the oldest back themselves.
+        If already started, only the thresholds are changed.
+        It's also started at mount when T2FS_FLUSHER is set, with
+            T2FS_DIRTY_AGE, T2FS_DIRTY_RATIO and T2FS_DIRTY_LIMIT.
+
+Input:  age_ms      -> Max time data stays dirty, in ms (at least 1)
+        dirty_ratio -> % of the cache dirty that wakes the thread up
+        dirty_limit -> % of the cache dirty that makes writers write back (not
+                       less than dirty_ratio)
+
+Return: On success, 0 is returned. Otherwise, a non-zero value is returned.
+-----------------------------------------------------------------------------*/
+int t2fs_flusher_start (uint32_t age_ms, uint32_t dirty_ratio,
+                        uint32_t dirty_limit);
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Stop the thread started by t2fs_flusher_start, waiting for it to
+            finish. Dirty data is left in the cache, to be written as usual.
+            umount2 and format2 stop it as well.
+-----------------------------------------------------------------------------*/
+void t2fs_flusher_stop (void);
+
+
 #endif // T2FS_H
@@ -31,5 +31,16 @@ enum filetype
     FILETYPE_SYMLINK,
 };
 
+// Kinds of data in the cache, counted separately in CACHESTAT2
+enum cache_kind
+{
+    CACHE_KIND_DATA = 0, // Contents of regular files and symlinks
+    CACHE_KIND_DIRECTORY,
+    CACHE_KIND_INDEX,    // Blocks of pointers of inodes
+    CACHE_KIND_INODE,    // Sectors of the inode table
+    CACHE_KIND_BITMAP,
+    CACHE_NUM_KINDS,
+};
+
 
 #endif // T2FS_DEF_H
@@ -1,37 +1,607 @@
+#define _GNU_SOURCE // For O_DIRECT
 #include "apidisk.h"
-#include <stdio.h>
+#include "apidisk_ext.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
 
-static char filename[] = "t2fs_disk.dat";
 
+/*********************************
+ *  File backend (pread/pwrite)  *
+ *********************************/
 
-int read_sector(unsigned int sector, unsigned char *buffer)
+static int disk_fd = -1; // Descriptor of the opened disk (-1 = closed)
+static int direct; // If disk_fd was opened with O_DIRECT
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Read or write the whole given size at the given disk byte offset,
+            retrying on interruptions and partial transfers.
+Return: On success, 0 is returned. Otherwise, -1 is returned.
+-----------------------------------------------------------------------------*/
+static int transfer(unsigned char *buffer, size_t size, off_t offset, int wr)
 {
-    FILE *fp = fopen(filename, "r+b");
-    if(!fp)
+    while(size > 0)
+    {
+        ssize_t res = wr ? pwrite(disk_fd, buffer, size, offset)
+                         : pread(disk_fd, buffer, size, offset);
+        if(res < 0 && errno == EINTR)
+            continue;
+        if(res <= 0) // Error or past the end of the disk
+            return -1;
+        buffer += res;
+        size -= res;
+        offset += res;
+    }
+    return 0;
+}
+
+/*-----------------------------------------------------------------------------
+Funct:  Check if a transfer can be done directly with O_DIRECT: the buffer
+            address, its size and the disk offset must be DISK_ALIGN multiples.
+-----------------------------------------------------------------------------*/
+static int is_aligned(const void *buffer, size_t size, off_t offset)
+{
+    return ((uintptr_t)buffer | size | (uintmax_t)offset) % DISK_ALIGN == 0;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Same as transfer, but any request can be given when O_DIRECT is in use.
+        Unaligned requests go through an aligned bounce buffer, widened to the
+            DISK_ALIGN units they touch. Units partially written are read first.
+            The buffer is allocated for each request, as T2FS threads (warm-up
+            and flusher) may transfer alongside the program.
+Return: On success, 0 is returned. Otherwise, -1 is returned.
+-----------------------------------------------------------------------------*/
+static int transfer_any(unsigned char *buffer, size_t size, off_t offset,
+                        int wr)
+{
+    if(!direct || is_aligned(buffer, size, offset))
+        return transfer(buffer, size, offset, wr);
+
+    off_t start = offset - offset % DISK_ALIGN;
+    off_t end = offset + size;
+    if(end % DISK_ALIGN != 0)
+        end += DISK_ALIGN - end % DISK_ALIGN;
+    size_t span = end - start;
+    unsigned char *bounce;
+    if(posix_memalign((void**)&bounce, DISK_ALIGN, span) != 0)
         return -1;
-    int res = fseek(fp, sector*SECTOR_SIZE, SEEK_SET);
-    if(res == 0) // fseek successful
+
+    int res = -1;
+    if(!wr)
+    {
+        res = transfer(bounce, span, start, 0);
+        if(res == 0)
+            memcpy(buffer, bounce + (offset - start), size);
+        free(bounce);
+        return res;
+    }
+
+    // Read the first and last units, if they are not entirely overwritten
+    if(offset != start && transfer(bounce, DISK_ALIGN, start, 0) != 0)
+        goto done;
+    if((off_t)(offset + size) != end && (span > DISK_ALIGN || offset == start)
+       && transfer(bounce + span - DISK_ALIGN, DISK_ALIGN,
+                   end - DISK_ALIGN, 0) != 0)
+        goto done;
+    memcpy(bounce + (offset - start), buffer, size);
+    res = transfer(bounce, span, start, 1);
+done:
+    free(bounce);
+    return res;
+}
+
+static int file_open(int flags)
+{
+    direct = 0;
+    if(flags & DISK_DIRECT)
     {
-        res = fread(buffer, SECTOR_SIZE, 1, fp); // fread() should return 1
-        res--;
+        disk_fd = open(DISK_FILENAME, O_RDWR | O_CLOEXEC | O_DIRECT);
+        struct stat st;
+        if(disk_fd >= 0 && fstat(disk_fd, &st) == 0
+           && st.st_size % DISK_ALIGN == 0)
+        {
+            direct = 1;
+            return 0;
+        }
+        // Host file system without O_DIRECT, or a disk size that can't be
+        //   transferred in whole units: use the page cache
+        if(disk_fd >= 0)
+            close(disk_fd);
     }
-    fclose(fp);
-    return res; // Will be 0 if it's successfully read a block
+    disk_fd = open(DISK_FILENAME, O_RDWR | O_CLOEXEC);
+    return disk_fd >= 0 ? 0 : -1;
 }
 
+static int file_close(void)
+{
+    uring_release();
+    int res = close(disk_fd);
+    disk_fd = -1;
+    return res;
+}
 
-int write_sector (unsigned int sector, unsigned char *buffer)
+static int file_flush(void)
+{
+    return fdatasync(disk_fd);
+}
+
+static int file_read(unsigned int sector, unsigned int count,
+                     unsigned char *buffer)
+{
+    return transfer_any(buffer, (size_t)count * SECTOR_SIZE,
+                        (off_t)sector * SECTOR_SIZE, 0);
+}
+
+static int file_write(unsigned int sector, unsigned int count,
+                      unsigned char *buffer)
+{
+    return transfer_any(buffer, (size_t)count * SECTOR_SIZE,
+                        (off_t)sector * SECTOR_SIZE, 1);
+}
+
+static int file_discard(unsigned int sector, unsigned int count)
+{
+    // The file keeps its size, and the hole reads back as zeros
+    return fallocate(disk_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                     (off_t)sector * SECTOR_SIZE, (off_t)count * SECTOR_SIZE);
+}
+
+/*-----------------------------------------------------------------------------
+Funct:  Read or write scattered buffers at the given sector with a single
+            preadv/pwritev. If it's not transferred all at once (interrupted,
+            too many buffers etc), the buffers are transferred one by one.
+Return: On success, 0 is returned. Otherwise, -1 is returned.
+-----------------------------------------------------------------------------*/
+static int transfer_v(unsigned int sector, const struct iovec *iov,
+                      int iovcnt, int wr)
+{
+    off_t offset = (off_t)sector * SECTOR_SIZE;
+    ssize_t total = 0;
+    for(int i=0; i<iovcnt; i++)
+        total += iov[i].iov_len;
+
+    ssize_t res = wr ? pwritev(disk_fd, iov, iovcnt, offset)
+                     : preadv(disk_fd, iov, iovcnt, offset);
+    if(res == total)
+        return 0;
+
+    for(int i=0; i<iovcnt; i++) // Slow path. Repeating a transfer is harmless
+    {
+        if(transfer_any(iov[i].iov_base, iov[i].iov_len, offset, wr) != 0)
+            return -1;
+        offset += iov[i].iov_len;
+    }
+    return 0;
+}
+
+static int file_readv(unsigned int sector, const struct iovec *iov, int iovcnt)
+{
+    return transfer_v(sector, iov, iovcnt, 0);
+}
+
+static int file_writev(unsigned int sector, const struct iovec *iov,
+                       int iovcnt)
+{
+    return transfer_v(sector, iov, iovcnt, 1);
+}
+
+static int file_submit(struct disk_request *reqs, int nreqs)
+{
+    int uring = 1; // With O_DIRECT, only aligned requests can go to io_uring
+    for(int i=0; direct && uring && i<nreqs; i++)
+    {
+        uring = is_aligned(reqs[i].buffer, (size_t)reqs[i].count * SECTOR_SIZE,
+                           (off_t)reqs[i].sector * SECTOR_SIZE);
+    }
+    int failed = uring ? uring_submit(disk_fd, reqs, nreqs) : -1;
+    if(failed >= 0)
+        return failed;
+
+    failed = 0; // io_uring unavailable: synchronous path
+    for(int i=0; i<nreqs; i++)
+    {
+        reqs[i].result = transfer_any(reqs[i].buffer,
+                                      (size_t)reqs[i].count * SECTOR_SIZE,
+                                      (off_t)reqs[i].sector * SECTOR_SIZE,
+                                      reqs[i].write);
+        if(reqs[i].result != 0)
+            failed++;
+    }
+    return failed;
+}
+
+const struct disk_ops disk_file_ops =
+{
+    .name    = "file",
+    .open    = file_open,
+    .close   = file_close,
+    .flush   = file_flush,
+    .read    = file_read,
+    .write   = file_write,
+    .readv   = file_readv,
+    .writev  = file_writev,
+    .submit  = file_submit,
+    .discard = file_discard,
+};
+
+
+/********************************************
+ *  Legacy backend (professor's apidisk.o)  *
+ ********************************************/
+
+#ifdef APIDISK_LEGACY
+
+static int legacy_open(int flags)
+{
+    (void)flags; // Unused parameter
+    return 0; // The professor's functions keep nothing opened
+}
+
+static int legacy_none(void)
+{
+    return 0;
+}
+
+static int legacy_read(unsigned int sector, unsigned int count,
+                       unsigned char *buffer)
+{
+    for(unsigned int i=0; i<count; i++, buffer+=SECTOR_SIZE)
+    {
+        if(read_sector(sector+i, buffer) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int legacy_write(unsigned int sector, unsigned int count,
+                        unsigned char *buffer)
+{
+    for(unsigned int i=0; i<count; i++, buffer+=SECTOR_SIZE)
+    {
+        if(write_sector(sector+i, buffer) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static const struct disk_ops disk_legacy_ops =
+{
+    .name    = "legacy",
+    .open    = legacy_open,
+    .close   = legacy_none,
+    .flush   = legacy_none,
+    .read    = legacy_read,
+    .write   = legacy_write,
+};
+
+#define DEFAULT_OPS disk_legacy_ops
+#elif defined(APIDISK_MMAP)
+#define DEFAULT_OPS disk_mmap_ops
+#else
+#define DEFAULT_OPS disk_file_ops
+#endif // APIDISK_LEGACY
+
+
+/********************
+ *  I/O accounting  *
+ ********************/
+
+// Counters of one thread, only written by that thread, so no locks are taken
+struct thread_stats
+{
+    struct disk_io_stats stats;
+    unsigned int next_sector[2]; // Sector after the last read and write
+    struct thread_stats *next;   // Next thread in the list
+};
+
+static struct thread_stats *all_threads; // Every thread that did disk I/O
+static __thread struct thread_stats *my_stats; // This thread's counters
+static struct disk_io_stats baseline; // Totals at the last reset
+
+// Increment a counter read by other threads (a plain add, but untorn)
+#define BUMP(counter, value) \
+    __atomic_store_n(&(counter), (counter) + (value), __ATOMIC_RELAXED)
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Get the counters of the calling thread, creating them on first use.
+Return: The counters, or NULL if there's no memory for them.
+-----------------------------------------------------------------------------*/
+static struct thread_stats *thread_stats(void)
+{
+    if(my_stats)
+        return my_stats;
+    struct thread_stats *ts = calloc(1, sizeof(*ts));
+    if(!ts)
+        return 0; // NULL
+    ts->next = __atomic_load_n(&all_threads, __ATOMIC_RELAXED);
+    while(!__atomic_compare_exchange_n(&all_threads, &ts->next, ts, 1,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ; // Another thread was added meanwhile: ts->next updated, try again
+    my_stats = ts;
+    return ts;
+}
+
+
+static unsigned long long now_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Account a finished disk request to the calling thread.
+Input:  wr     -> If it was a read (0) or a write (non-zero)
+        sector -> First sector of the request
+        count  -> Number of sectors of the request
+        start  -> now_ns() when the request started
+        res    -> Result of the request (0 = success)
+-----------------------------------------------------------------------------*/
+static void account(int wr, unsigned int sector, unsigned int count,
+                    unsigned long long start, int res)
 {
-    FILE *fp = fopen(filename, "r+b");
-    if(!fp)
+    unsigned long long ns = now_ns() - start;
+    struct thread_stats *ts = thread_stats();
+    if(!ts)
+        return;
+    struct disk_io_counters *c = wr ? &ts->stats.write : &ts->stats.read;
+
+    BUMP(c->requests, 1);
+    BUMP(c->sectors, count);
+    BUMP(c->bytes, (unsigned long long)count * SECTOR_SIZE);
+    if(sector == ts->next_sector[wr != 0])
+        BUMP(c->sequential, 1);
+    else
+        BUMP(c->random, 1);
+    ts->next_sector[wr != 0] = sector + count;
+    if(res != 0)
+        BUMP(c->errors, 1);
+    BUMP(c->time_ns, ns);
+
+    // Bucket i holds latencies in [2^(i-1), 2^i) ns, the last one also above
+    int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+    if(bucket >= DISK_HIST_BUCKETS)
+        bucket = DISK_HIST_BUCKETS - 1;
+    BUMP(c->hist[bucket], 1);
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Add the counters of every thread, minus the given baseline.
+        All fields of struct disk_io_stats are unsigned long long counters.
+-----------------------------------------------------------------------------*/
+static void sum_stats(struct disk_io_stats *total,
+                      const struct disk_io_stats *base)
+{
+    const int n = sizeof(*total) / sizeof(unsigned long long);
+    unsigned long long *t = (unsigned long long*)total;
+    const unsigned long long *b = (const unsigned long long*)base;
+    for(int i=0; i<n; i++)
+        t[i] = -b[i];
+
+    struct thread_stats *ts = __atomic_load_n(&all_threads, __ATOMIC_ACQUIRE);
+    for(; ts; ts = ts->next)
+    {
+        unsigned long long *s = (unsigned long long*)&ts->stats;
+        for(int i=0; i<n; i++)
+            t[i] += __atomic_load_n(&s[i], __ATOMIC_RELAXED);
+    }
+}
+
+
+void t2fs_io_stats(struct disk_io_stats *stats)
+{
+    struct disk_io_stats base = baseline;
+    sum_stats(stats, &base);
+}
+
+
+void t2fs_io_stats_reset(void)
+{
+    struct disk_io_stats zero;
+    memset(&zero, 0, sizeof(zero));
+    sum_stats(&baseline, &zero);
+}
+
+
+/**********************
+ *  Backend dispatch  *
+ **********************/
+
+static const struct disk_ops *ops = &DEFAULT_OPS; // Backend being used
+static int opened; // If ops->open has been called successfully
+static int flags; // Flags (DISK_*) for the next ops->open
+
+
+int set_disk_ops(const struct disk_ops *new_ops)
+{
+    int res = close_disk();
+    ops = new_ops;
+    return res;
+}
+
+
+const struct disk_ops *get_disk_ops(void)
+{
+    return ops;
+}
+
+
+int set_disk_flags(int new_flags)
+{
+    if(new_flags == flags)
+        return 0;
+    int res = close_disk(); // Opened again with the new flags on demand
+    flags = new_flags;
+    return res;
+}
+
+
+int open_disk(void)
+{
+    if(opened) // Already opened
+        return 0;
+    if(ops->open(flags) != 0)
         return -1;
-    int res = fseek(fp, sector*SECTOR_SIZE, SEEK_SET);
-    if(res == 0) // fseek successful
+    opened = 1;
+    return 0;
+}
+
+
+int close_disk(void)
+{
+    if(!opened) // Not opened
+        return 0;
+    opened = 0;
+    return ops->close();
+}
+
+
+int flush_disk(void)
+{
+    if(!opened) // Nothing written since it was closed
+        return 0;
+    return ops->flush();
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Read or write consecutive sectors with the backend, accounting it.
+Return: On success, 0 is returned. Otherwise, a non-zero value is returned.
+-----------------------------------------------------------------------------*/
+static int rw_sectors(unsigned int sector, unsigned int count,
+                      unsigned char *buffer, int wr)
+{
+    if(open_disk() != 0)
+        return -1;
+    unsigned long long start = now_ns();
+    int res = wr ? ops->write(sector, count, buffer)
+                 : ops->read(sector, count, buffer);
+    account(wr, sector, count, start, res);
+    return res;
+}
+
+
+int read_sectors(unsigned int sector, unsigned int count,
+                 unsigned char *buffer)
+{
+    return rw_sectors(sector, count, buffer, 0);
+}
+
+
+int write_sectors(unsigned int sector, unsigned int count,
+                  unsigned char *buffer)
+{
+    return rw_sectors(sector, count, buffer, 1);
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Read or write scattered buffers with the backend's vectored function
+            or, if it has none, one backend request per buffer.
+Return: On success, 0 is returned. Otherwise, a non-zero value is returned.
+-----------------------------------------------------------------------------*/
+static int rw_sectors_v(unsigned int sector, const struct iovec *iov,
+                        int iovcnt, int wr)
+{
+    if(open_disk() != 0)
+        return -1;
+    unsigned int total = 0;
+    for(int i=0; i<iovcnt; i++)
+        total += iov[i].iov_len / SECTOR_SIZE;
+    unsigned long long start = now_ns();
+    int res = 0;
+    if(wr && ops->writev)
+        res = ops->writev(sector, iov, iovcnt);
+    else if(!wr && ops->readv)
+        res = ops->readv(sector, iov, iovcnt);
+    else
     {
-        res = fwrite(buffer, SECTOR_SIZE, 1, fp); // fwrite() should return 1
-        res--;
+        unsigned int s = sector;
+        for(int i=0; i<iovcnt && res == 0; i++)
+        {
+            unsigned int count = iov[i].iov_len / SECTOR_SIZE;
+            res = wr ? ops->write(s, count, iov[i].iov_base)
+                     : ops->read(s, count, iov[i].iov_base);
+            s += count;
+        }
     }
-    fclose(fp);
+    account(wr, sector, total, start, res);
     return res;
 }
 
+
+int readv_sectors(unsigned int sector, const struct iovec *iov, int iovcnt)
+{
+    return rw_sectors_v(sector, iov, iovcnt, 0);
+}
+
+
+int writev_sectors(unsigned int sector, const struct iovec *iov, int iovcnt)
+{
+    return rw_sectors_v(sector, iov, iovcnt, 1);
+}
+
+
+int discard_sectors(unsigned int sector, unsigned int count)
+{
+    if(open_disk() != 0)
+        return -1;
+    if(!ops->discard) // Can't guarantee the sectors read back as zeros
+        return -1;
+    return ops->discard(sector, count);
+}
+
+
+int submit_sectors(struct disk_request *reqs, int nreqs)
+{
+    if(open_disk() != 0)
+        return -1;
+    unsigned long long start = now_ns();
+    int failed = 0;
+    if(ops->submit)
+        failed = ops->submit(reqs, nreqs);
+    else
+    {
+        for(int i=0; i<nreqs; i++)
+        {
+            struct disk_request *r = &reqs[i];
+            r->result = r->write ? ops->write(r->sector, r->count, r->buffer)
+                                 : ops->read(r->sector, r->count, r->buffer);
+            if(r->result != 0)
+                failed++;
+        }
+    }
+    // Each request is charged the time of the whole batch
+    for(int i=0; i<nreqs; i++)
+        account(reqs[i].write, reqs[i].sector, reqs[i].count, start,
+                failed < 0 ? -1 : reqs[i].result);
+    return failed;
+}
+
+
+#ifndef APIDISK_LEGACY // Otherwise, these are in the professor's apidisk.o
+
+int read_sector(unsigned int sector, unsigned char *buffer)
+{
+    return rw_sectors(sector, 1, buffer, 0);
+}
+
+
+int write_sector (unsigned int sector, unsigned char *buffer)
+{
+    return rw_sectors(sector, 1, buffer, 1);
+}
+
+#endif // APIDISK_LEGACY
@@ -0,0 +1,135 @@
+#include "apidisk.h"
+#include "apidisk_ext.h"
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+
+static unsigned char *disk_map; // "t2fs_disk.dat" mapped in memory
+static size_t disk_size; // Size of the mapping, in bytes
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Check whether the given sectors are inside the mapped disk.
+-----------------------------------------------------------------------------*/
+static int in_disk(unsigned int sector, unsigned int count)
+{
+    return (size_t)sector + count <= disk_size / SECTOR_SIZE;
+}
+
+static int mmap_open(int flags)
+{
+    (void)flags; // Mapped pages always go through the page cache
+    int fd = open(DISK_FILENAME, O_RDWR | O_CLOEXEC);
+    if(fd < 0)
+        return -1;
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size < SECTOR_SIZE)
+    {
+        close(fd);
+        return -1;
+    }
+    disk_size = st.st_size;
+    disk_map = mmap(NULL, disk_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd); // The mapping keeps the file referenced
+    if(disk_map == MAP_FAILED)
+    {
+        disk_map = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static int mmap_close(void)
+{
+    int res = munmap(disk_map, disk_size); // Dirty pages are kept by the OS
+    disk_map = NULL;
+    disk_size = 0;
+    return res;
+}
+
+static int mmap_flush(void)
+{
+    return msync(disk_map, disk_size, MS_SYNC);
+}
+
+static int mmap_read(unsigned int sector, unsigned int count,
+                     unsigned char *buffer)
+{
+    if(!in_disk(sector, count))
+        return -1;
+    memcpy(buffer, disk_map + (size_t)sector * SECTOR_SIZE,
+           (size_t)count * SECTOR_SIZE);
+    return 0;
+}
+
+static int mmap_write(unsigned int sector, unsigned int count,
+                      unsigned char *buffer)
+{
+    if(!in_disk(sector, count))
+        return -1;
+    memcpy(disk_map + (size_t)sector * SECTOR_SIZE, buffer,
+           (size_t)count * SECTOR_SIZE);
+    return 0;
+}
+
+static int mmap_readv(unsigned int sector, const struct iovec *iov, int iovcnt)
+{
+    for(int i=0; i<iovcnt; i++)
+    {
+        unsigned int count = iov[i].iov_len / SECTOR_SIZE;
+        if(mmap_read(sector, count, iov[i].iov_base) != 0)
+            return -1;
+        sector += count;
+    }
+    return 0;
+}
+
+static int mmap_writev(unsigned int sector, const struct iovec *iov,
+                       int iovcnt)
+{
+    for(int i=0; i<iovcnt; i++)
+    {
+        unsigned int count = iov[i].iov_len / SECTOR_SIZE;
+        if(mmap_write(sector, count, iov[i].iov_base) != 0)
+            return -1;
+        sector += count;
+    }
+    return 0;
+}
+
+static int mmap_discard(unsigned int sector, unsigned int count)
+{
+    if(!in_disk(sector, count))
+        return -1;
+    // Whole pages are punched out of the file (MADV_REMOVE), the rest zeroed
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t start = (size_t)sector * SECTOR_SIZE;
+    size_t end = start + (size_t)count * SECTOR_SIZE;
+    size_t first = (start + page - 1) / page * page, last = end / page * page;
+    if(first >= last
+       || madvise(disk_map + first, last - first, MADV_REMOVE) != 0)
+    {
+        first = last = end; // Not supported: zero everything
+    }
+    memset(disk_map + start, 0, MIN(first, end) - start);
+    memset(disk_map + MAX(last, start), 0, end - MAX(last, start));
+    return 0;
+}
+
+const struct disk_ops disk_mmap_ops =
+{
+    .name    = "mmap",
+    .open    = mmap_open,
+    .close   = mmap_close,
+    .flush   = mmap_flush,
+    .read    = mmap_read,
+    .write   = mmap_write,
+    .readv   = mmap_readv,
+    .writev  = mmap_writev,
+    .discard = mmap_discard,
+};
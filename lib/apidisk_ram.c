@@ -0,0 +1,192 @@
+#define _GNU_SOURCE // For MAP_HUGETLB
+#include "apidisk.h"
+#include "apidisk_ext.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define HUGE_PAGE (2U << 20) // Size of huge pages tried for the RAM disk
+
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+
+static unsigned char *ram; // The disk contents (NULL = no RAM disk)
+static size_t ram_size; // Size of the disk, in bytes
+static size_t map_size; // Size of the mapping (ram_size rounded up)
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Check whether the given sectors are inside the RAM disk.
+-----------------------------------------------------------------------------*/
+static int in_disk(unsigned int sector, unsigned int count)
+{
+    return (size_t)sector + count <= ram_size / SECTOR_SIZE;
+}
+
+static int ram_open(int flags)
+{
+    (void)flags; // Unused parameter
+    return ram ? 0 : -1;
+}
+
+static int ram_none(void)
+{
+    return 0; // The contents stay in memory until ramdisk_destroy
+}
+
+static int ram_read(unsigned int sector, unsigned int count,
+                    unsigned char *buffer)
+{
+    if(!in_disk(sector, count))
+        return -1;
+    memcpy(buffer, ram + (size_t)sector * SECTOR_SIZE,
+           (size_t)count * SECTOR_SIZE);
+    return 0;
+}
+
+static int ram_write(unsigned int sector, unsigned int count,
+                     unsigned char *buffer)
+{
+    if(!in_disk(sector, count))
+        return -1;
+    memcpy(ram + (size_t)sector * SECTOR_SIZE, buffer,
+           (size_t)count * SECTOR_SIZE);
+    return 0;
+}
+
+static int ram_discard(unsigned int sector, unsigned int count)
+{
+    if(!in_disk(sector, count))
+        return -1;
+    // Whole pages are given back to the system (and read back as zeros),
+    //   the rest zeroed
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t start = (size_t)sector * SECTOR_SIZE;
+    size_t end = start + (size_t)count * SECTOR_SIZE;
+    size_t first = (start + page - 1) / page * page, last = end / page * page;
+    if(first >= last || madvise(ram + first, last - first, MADV_DONTNEED) != 0)
+        first = last = end; // Not supported (e.g. huge pages): zero everything
+    memset(ram + start, 0, MIN(first, end) - start);
+    memset(ram + MAX(last, start), 0, end - MAX(last, start));
+    return 0;
+}
+
+const struct disk_ops disk_ram_ops =
+{
+    .name    = "ram",
+    .open    = ram_open,
+    .close   = ram_none,
+    .flush   = ram_none,
+    .read    = ram_read,
+    .write   = ram_write,
+    .discard = ram_discard,
+};
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Allocate zeroed memory for a RAM disk of the given size, replacing the
+            current one. Huge pages are used if the system has them reserved.
+Return: On success, 0 is returned. Otherwise, -1 is returned.
+-----------------------------------------------------------------------------*/
+static int ram_alloc(size_t size)
+{
+    ramdisk_destroy();
+    map_size = (size + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+    ram = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if(ram == MAP_FAILED) // No huge pages reserved: regular pages
+    {
+        map_size = size;
+        ram = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if(ram == MAP_FAILED)
+    {
+        ram = NULL;
+        return -1;
+    }
+    ram_size = size;
+    return 0;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Write a little-endian integer of the given number of bytes.
+-----------------------------------------------------------------------------*/
+static void put_le(unsigned char *dst, uint32_t value, int bytes)
+{
+    for(int i=0; i<bytes; i++, value >>= 8)
+        dst[i] = value & 0xFF;
+}
+
+
+int ramdisk_create(unsigned int num_sectors, const unsigned char *mbr)
+{
+    if(num_sectors < 2)
+        return -1;
+    if(ram_alloc((size_t)num_sectors * SECTOR_SIZE) != 0)
+        return -1;
+
+    if(mbr)
+        memcpy(ram, mbr, SECTOR_SIZE);
+    else // One partition with all sectors after the MBR (see t2fs_mbr)
+    {
+        put_le(ram + 0, 0x7E31, 2);          // version
+        put_le(ram + 2, SECTOR_SIZE, 2);     // sector_size
+        put_le(ram + 4, 8, 2);               // pt_offset
+        put_le(ram + 6, 4, 2);               // pt_entries
+        put_le(ram + 8, 1, 4);               // ptable[0].first_sector
+        put_le(ram + 12, num_sectors - 1, 4); // ptable[0].last_sector
+        strcpy((char*)ram + 16, "RAMDISK");  // ptable[0].name
+    }
+    return set_disk_ops(&disk_ram_ops);
+}
+
+
+int ramdisk_load(const char *filename)
+{
+    FILE *fp = fopen(filename ? filename : DISK_FILENAME, "rb");
+    if(!fp)
+        return -1;
+    long size = -1;
+    if(fseek(fp, 0, SEEK_END) == 0)
+        size = ftell(fp);
+    int res = -1;
+    if(size >= SECTOR_SIZE && fseek(fp, 0, SEEK_SET) == 0
+       && ram_alloc(size - size % SECTOR_SIZE) == 0)
+    {
+        res = fread(ram, ram_size, 1, fp) == 1 ? 0 : -1;
+    }
+    fclose(fp);
+    if(res != 0)
+    {
+        ramdisk_destroy();
+        return res;
+    }
+    return set_disk_ops(&disk_ram_ops);
+}
+
+
+int ramdisk_save(const char *filename)
+{
+    if(!ram)
+        return -1;
+    FILE *fp = fopen(filename ? filename : DISK_FILENAME, "wb");
+    if(!fp)
+        return -1;
+    int res = fwrite(ram, ram_size, 1, fp) == 1 ? 0 : -1;
+    if(fclose(fp) != 0)
+        res = -1;
+    return res;
+}
+
+
+void ramdisk_destroy(void)
+{
+    if(ram)
+        munmap(ram, map_size);
+    ram = NULL;
+    ram_size = map_size = 0;
+}
@@ -0,0 +1,284 @@
+#include "apidisk.h"
+#include "apidisk_ext.h"
+#include <pthread.h>
+
+#define NS_PER_SEC 1000000000ULL
+
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+
+const struct disk_sim_model disk_sim_hdd =
+{
+    .ssd = 0,
+    .seek_min_ns = 1000000,    // 1 ms, track to track
+    .seek_max_ns = 18000000,   // 18 ms, full stroke
+    .rpm = 7200,
+    .bytes_per_sec = 150000000, // 150 MB/s
+};
+
+const struct disk_sim_model disk_sim_ssd =
+{
+    .ssd = 1,
+    .read_ns = 80000,   // 80 us
+    .write_ns = 200000, // 200 us
+    .channels = 8,
+    .bytes_per_sec = 500000000, // 500 MB/s
+};
+
+static const struct disk_ops *inner; // The wrapped backend (NULL = stopped)
+static struct disk_sim_model model;
+static unsigned int disk_sectors; // Size of the simulated disk, in sectors
+static unsigned long long clock_ns; // Virtual clock
+static unsigned int head; // HDD: sector under the head
+
+// Held while the clock and the head are used, as T2FS threads (warm-up and
+//   flusher) may do I/O alongside the program's
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Integer square root (rounded down).
+-----------------------------------------------------------------------------*/
+static unsigned long long isqrt(unsigned long long x)
+{
+    unsigned long long r = 0;
+    for(unsigned long long bit = 1ULL << 62; bit; bit >>= 2)
+    {
+        if(x >= r + bit)
+        {
+            x -= r + bit;
+            r = (r >> 1) + bit;
+        }
+        else
+            r >>= 1;
+    }
+    return r;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Get the time the simulated device takes to carry out a request alone.
+        HDD: the head moves to the first sector, unless it's already there,
+            costing a seek and, on average, half a rotation.
+        SSD: a fixed latency, depending on the kind of request.
+        Both: plus the time to transfer the data.
+Return: The time, in ns.
+-----------------------------------------------------------------------------*/
+static unsigned long long request_ns(unsigned int sector, unsigned int count,
+                                     int wr)
+{
+    unsigned long long ns = 0;
+    if(model.bytes_per_sec)
+        ns = (unsigned long long)count * SECTOR_SIZE * NS_PER_SEC
+           / model.bytes_per_sec;
+
+    if(model.ssd)
+        return ns + (wr ? model.write_ns : model.read_ns);
+
+    if(sector != head)
+    {
+        // Seek time grows with the square root of the distance
+        unsigned long long dist = sector > head ? sector - head : head - sector;
+        dist = MIN(dist, disk_sectors);
+        unsigned long long frac = isqrt((dist << 20) / MAX(disk_sectors, 1));
+        ns += model.seek_min_ns
+            + (model.seek_max_ns - model.seek_min_ns) * frac / (1 << 10);
+        if(model.rpm)
+            ns += 30 * NS_PER_SEC / model.rpm; // Half a rotation
+    }
+    head = sector + count;
+    return ns;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Charge a request alone on the virtual clock (see request_ns).
+-----------------------------------------------------------------------------*/
+static void charge(unsigned int sector, unsigned int count, int wr)
+{
+    pthread_mutex_lock(&lock);
+    clock_ns += request_ns(sector, count, wr);
+    pthread_mutex_unlock(&lock);
+}
+
+static int sim_open(int flags)
+{
+    return inner->open(flags);
+}
+
+static int sim_close(void)
+{
+    return inner->close();
+}
+
+static int sim_flush(void)
+{
+    return inner->flush();
+}
+
+static int sim_read(unsigned int sector, unsigned int count,
+                    unsigned char *buffer)
+{
+    charge(sector, count, 0);
+    return inner->read(sector, count, buffer);
+}
+
+static int sim_write(unsigned int sector, unsigned int count,
+                     unsigned char *buffer)
+{
+    charge(sector, count, 1);
+    return inner->write(sector, count, buffer);
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Read or write scattered buffers with the wrapped backend, charging a
+            single request.
+Return: On success, 0 is returned. Otherwise, a non-zero value is returned.
+-----------------------------------------------------------------------------*/
+static int sim_rw_v(unsigned int sector, const struct iovec *iov, int iovcnt,
+                    int wr)
+{
+    unsigned int total = 0;
+    for(int i=0; i<iovcnt; i++)
+        total += iov[i].iov_len / SECTOR_SIZE;
+    charge(sector, total, wr);
+
+    if(wr && inner->writev)
+        return inner->writev(sector, iov, iovcnt);
+    if(!wr && inner->readv)
+        return inner->readv(sector, iov, iovcnt);
+    for(int i=0; i<iovcnt; i++)
+    {
+        unsigned int count = iov[i].iov_len / SECTOR_SIZE;
+        int res = wr ? inner->write(sector, count, iov[i].iov_base)
+                     : inner->read(sector, count, iov[i].iov_base);
+        if(res != 0)
+            return res;
+        sector += count;
+    }
+    return 0;
+}
+
+static int sim_readv(unsigned int sector, const struct iovec *iov, int iovcnt)
+{
+    return sim_rw_v(sector, iov, iovcnt, 0);
+}
+
+static int sim_writev(unsigned int sector, const struct iovec *iov, int iovcnt)
+{
+    return sim_rw_v(sector, iov, iovcnt, 1);
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Carry out a batch with the wrapped backend, charging its time.
+        HDD: the requests are served one after the other, in the given order.
+        SSD: the requests are served in waves of 'channels' requests in
+            parallel, each wave taking as long as its slowest request.
+Return: The number of requests that failed.
+-----------------------------------------------------------------------------*/
+static int sim_submit(struct disk_request *reqs, int nreqs)
+{
+    unsigned int channels = model.ssd ? MAX(model.channels, 1) : 1;
+    pthread_mutex_lock(&lock);
+    for(int i=0; i<nreqs; i += channels)
+    {
+        unsigned long long wave = 0;
+        for(int j=i; j<nreqs && j<(int)(i + channels); j++)
+        {
+            unsigned long long ns = request_ns(reqs[j].sector, reqs[j].count,
+                                               reqs[j].write);
+            wave = MAX(wave, ns);
+        }
+        clock_ns += wave;
+    }
+    pthread_mutex_unlock(&lock);
+
+    if(inner->submit)
+        return inner->submit(reqs, nreqs);
+    int failed = 0;
+    for(int i=0; i<nreqs; i++)
+    {
+        struct disk_request *r = &reqs[i];
+        r->result = r->write ? inner->write(r->sector, r->count, r->buffer)
+                             : inner->read(r->sector, r->count, r->buffer);
+        if(r->result != 0)
+            failed++;
+    }
+    return failed;
+}
+
+static int sim_discard(unsigned int sector, unsigned int count)
+{
+    if(!inner->discard)
+        return -1;
+    return inner->discard(sector, count); // Free on the simulated device
+}
+
+static const struct disk_ops disk_sim_ops =
+{
+    .name    = "sim",
+    .open    = sim_open,
+    .close   = sim_close,
+    .flush   = sim_flush,
+    .read    = sim_read,
+    .write   = sim_write,
+    .readv   = sim_readv,
+    .writev  = sim_writev,
+    .submit  = sim_submit,
+    .discard = sim_discard,
+};
+
+
+int disk_sim_start(const struct disk_sim_model *new_model,
+                   unsigned int num_sectors)
+{
+    if(inner) // Already started: only the model changes
+    {
+        model = *new_model;
+        disk_sectors = num_sectors;
+        return 0;
+    }
+    const struct disk_ops *current = get_disk_ops();
+    int res = set_disk_ops(&disk_sim_ops);
+    inner = current;
+    model = *new_model;
+    disk_sectors = num_sectors;
+    disk_sim_reset();
+    return res;
+}
+
+
+int disk_sim_stop(void)
+{
+    if(!inner)
+        return 0;
+    int res = set_disk_ops(inner);
+    inner = 0; // NULL
+    return res;
+}
+
+
+int disk_sim_active(void)
+{
+    return inner != 0;
+}
+
+
+unsigned long long disk_sim_time(void)
+{
+    pthread_mutex_lock(&lock);
+    unsigned long long ns = clock_ns;
+    pthread_mutex_unlock(&lock);
+    return ns;
+}
+
+
+void disk_sim_reset(void)
+{
+    pthread_mutex_lock(&lock);
+    clock_ns = 0;
+    head = 0;
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,235 @@
+#include "apidisk.h"
+#include "apidisk_ext.h"
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define RING_ENTRIES 64 // Maximum number of requests in flight
+
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+
+// Submission and completion queues, shared with the kernel
+static struct
+{
+    int fd;    // Ring descriptor (-1 = not set up)
+    int state; // 0 = not tried yet; 1 = ready; -1 = unavailable
+    void *sq_ptr, *cq_ptr; // Mapped rings (may be the same mapping)
+    size_t sq_size, cq_size, sqes_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sq_entries;
+} ring = { .fd = -1 };
+
+static struct iovec ring_iov[RING_ENTRIES]; // One buffer for each request
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Set up the ring, mapping its queues.
+Return: On success, 0 is returned. Otherwise, -1 is returned and the ring is
+            marked as unavailable (e.g. kernel without io_uring).
+-----------------------------------------------------------------------------*/
+static int ring_setup(void)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring.fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+    if(ring.fd < 0)
+        goto fail;
+
+    ring.sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring.cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+        ring.sq_size = ring.cq_size = MAX(ring.sq_size, ring.cq_size);
+
+    ring.sq_ptr = mmap(NULL, ring.sq_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if(ring.sq_ptr == MAP_FAILED)
+        goto fail;
+    ring.cq_ptr = ring.sq_ptr;
+    if(!(p.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        ring.cq_ptr = mmap(NULL, ring.cq_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, ring.fd,
+                           IORING_OFF_CQ_RING);
+        if(ring.cq_ptr == MAP_FAILED)
+            goto fail;
+    }
+    ring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if(ring.sqes == MAP_FAILED)
+        goto fail;
+
+    char *sq = ring.sq_ptr, *cq = ring.cq_ptr;
+    ring.sq_head  = (unsigned*)(sq + p.sq_off.head);
+    ring.sq_tail  = (unsigned*)(sq + p.sq_off.tail);
+    ring.sq_mask  = (unsigned*)(sq + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned*)(sq + p.sq_off.array);
+    ring.cq_head  = (unsigned*)(cq + p.cq_off.head);
+    ring.cq_tail  = (unsigned*)(cq + p.cq_off.tail);
+    ring.cq_mask  = (unsigned*)(cq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    ring.sq_entries = MIN(p.sq_entries, RING_ENTRIES); // ring_iov's size
+    ring.state = 1;
+    return 0;
+
+fail:
+    uring_release();
+    ring.state = -1;
+    return -1;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Reap the completions available, setting the result of their requests.
+        Requests transferred partially are completed synchronously.
+Return: The number of completions reaped.
+-----------------------------------------------------------------------------*/
+static unsigned ring_reap(int fd, struct disk_request *reqs)
+{
+    unsigned head = *ring.cq_head, reaped = 0;
+    unsigned cq_tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    for(; head != cq_tail; head++, reaped++)
+    {
+        struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+        struct disk_request *r = &reqs[cqe->user_data];
+        size_t size = (size_t)r->count * SECTOR_SIZE;
+        r->result = 0;
+        if(cqe->res < 0)
+            r->result = -1;
+        else if((size_t)cqe->res < size) // Partial: finish synchronously
+        {
+            size_t rem = size - cqe->res;
+            unsigned char *buf = r->buffer + cqe->res;
+            off_t off = (off_t)r->sector * SECTOR_SIZE + cqe->res;
+            while(rem > 0 && r->result == 0)
+            {
+                ssize_t t = r->write ? pwrite(fd, buf, rem, off)
+                                     : pread(fd, buf, rem, off);
+                if(t < 0 && errno == EINTR)
+                    continue;
+                if(t <= 0)
+                    r->result = -1;
+                else
+                {
+                    buf += t;
+                    off += t;
+                    rem -= t;
+                }
+            }
+        }
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    return reaped;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Queue a chunk of requests, submit them all with a single system call
+            and reap their completions.
+        If io_uring_enter fails, the requests the kernel has taken are waited
+            for, as it still uses their buffers, and the ring is released, to
+            be set up again without the others (uring_submit does it). The
+            requests not completed are failed.
+Return: The number of requests that failed.
+-----------------------------------------------------------------------------*/
+static int ring_chunk(int fd, struct disk_request *reqs, unsigned n)
+{
+    unsigned tail = *ring.sq_tail;
+    for(unsigned i=0; i<n; i++, tail++)
+    {
+        unsigned idx = tail & *ring.sq_mask;
+        struct io_uring_sqe *sqe = &ring.sqes[idx];
+        ring_iov[i].iov_base = reqs[i].buffer;
+        ring_iov[i].iov_len = (size_t)reqs[i].count * SECTOR_SIZE;
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = reqs[i].write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->fd = fd;
+        sqe->off = (uint64_t)reqs[i].sector * SECTOR_SIZE;
+        sqe->addr = (uint64_t)(uintptr_t)&ring_iov[i];
+        sqe->len = 1;
+        sqe->user_data = i;
+        ring.sq_array[idx] = idx;
+        reqs[i].result = -1; // Until completed
+    }
+    __atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+
+    unsigned to_submit = n, done = 0;
+    while(done < n)
+    {
+        int res = syscall(__NR_io_uring_enter, ring.fd, to_submit, n - done,
+                          IORING_ENTER_GETEVENTS, NULL, 0);
+        if(res < 0 && errno != EINTR && errno != EAGAIN)
+        {
+            unsigned taken = n - to_submit;
+            done += ring_reap(fd, reqs);
+            while(done < taken)
+            {
+                res = syscall(__NR_io_uring_enter, ring.fd, 0, taken - done,
+                              IORING_ENTER_GETEVENTS, NULL, 0);
+                if(res < 0 && errno != EINTR)
+                    break; // Can't wait anymore
+                done += ring_reap(fd, reqs);
+            }
+            uring_release();
+            break;
+        }
+        if(res > 0)
+            to_submit -= MIN((unsigned)res, to_submit);
+        done += ring_reap(fd, reqs);
+    }
+
+    int failed = 0;
+    for(unsigned i=0; i<n; i++)
+        failed += reqs[i].result != 0;
+    return failed;
+}
+
+
+int uring_submit(int fd, struct disk_request *reqs, int nreqs)
+{
+    if(ring.state == 0)
+        ring_setup();
+    if(ring.state < 0)
+        return -1;
+
+    int failed = 0;
+    while(nreqs > 0)
+    {
+        if(ring.state == 0 && ring_setup() != 0) // Released by ring_chunk
+        {
+            for(int i=0; i<nreqs; i++)
+                reqs[i].result = -1;
+            return failed + nreqs;
+        }
+        unsigned n = MIN((unsigned)nreqs, ring.sq_entries);
+        failed += ring_chunk(fd, reqs, n);
+        reqs += n;
+        nreqs -= n;
+    }
+    return failed;
+}
+
+
+void uring_release(void)
+{
+    if(ring.sqes && ring.sqes != MAP_FAILED)
+        munmap(ring.sqes, ring.sqes_size);
+    if(ring.cq_ptr && ring.cq_ptr != MAP_FAILED && ring.cq_ptr != ring.sq_ptr)
+        munmap(ring.cq_ptr, ring.cq_size);
+    if(ring.sq_ptr && ring.sq_ptr != MAP_FAILED)
+        munmap(ring.sq_ptr, ring.sq_size);
+    if(ring.fd >= 0)
+        close(ring.fd);
+    int state = ring.state;
+    memset(&ring, 0, sizeof(ring));
+    ring.fd = -1;
+    ring.state = state < 0 ? -1 : 0; // Don't try again if it's unavailable
+}
@@ -39,7 +39,7 @@ static void calculate_inode_table(u32 inode, u32 *sector, int *byte)
 
 
 /*-----------------------------------------------------------------------------
-Funct:  Operate either the inodes bitmap or the blocks bitmap.
+Funct:  Operate either the inodes bitmap or the blocks bitmap (see bitmap.c).
         The following operations are permitted:
             -1 : check if the given inode/block is being used
              0 : mark the given inode/block as being free (clear)
@@ -54,26 +54,22 @@ Return: On success with operation -1, the return is 0 if the inode/block is not
 -----------------------------------------------------------------------------*/
 static int operate_bitmap(u32 number, bool inode, int operation)
 {
-    u32 sector = number / (8 * superblock.sector_size);
-    sector += inode ? superblock.ib_offset : superblock.bb_offset;
-    int byte = number % (8 * superblock.sector_size);
-    int bit = number % 8;
-
-    byte_t data;
-    if(t2fs_read_sector(&data, sector, byte, 1) != 0)
-        return -1;
-
     if(operation == -1) // Check
-        return CHK_BIT(data, bit);
+        return t2fs_bitmap_get(number, inode);
 
-    if(operation == 0) // Clear
-        CLR_BIT(data, bit);
-    else // Set (operation == 1)
-        SET_BIT(data, bit);
-
-    if(t2fs_write_sector(&data, sector, byte, 1) != 0)
+    if(t2fs_bitmap_set(number, inode, operation == 1) != 0)
         return -1;
 
+    if(!inode) // Freed blocks are discarded later, unless used again before
+    {
+        u32 first = superblock.first_sector + superblock.blocks_offset
+                  + number * superblock.sectors_per_block;
+        if(operation == 0)
+            t2fs_queue_discard(first, superblock.sectors_per_block);
+        else
+            t2fs_queue_reuse(first, superblock.sectors_per_block);
+    }
+
     return 0;
 }
 
@@ -86,16 +82,7 @@ Return: On success, returns the first inode/block found (positive integer).
 -----------------------------------------------------------------------------*/
 static u32 first_free(bool inode)
 {
-    u32 num = inode ? superblock.num_inodes : superblock.num_blocks;
-    for(u32 i=1U; i<num; i++)
-    {
-        // If operate_bitmap returns an error (-1), the if will be false
-        // It is safer to not use it in case of error
-        if(!operate_bitmap(i, inode, -1))
-            return i;
-    }
-
-    return 0; // No free inodes/blocks available
+    return t2fs_bitmap_find(inode);
 }
 
 
@@ -135,10 +122,11 @@ static int iterate_indirection(u32 block, int level,
     if(level == 0)
         return fn(block, args);
 
-    u32 *buffer = idx_block_buffer[level-1];
-    int res = t2fs_read_block((byte_t*)buffer, block);
+    struct block_handle h;
+    int res = t2fs_get_block(&h, block, CACHE_KIND_INDEX, false);
     if(res != 0)
         return res;
+    u32 *buffer = (u32*)h.data;
 
     int num_iter = superblock.block_size / sizeof(u32);
     for(int i=0; i<num_iter; i++)
@@ -153,6 +141,7 @@ static int iterate_indirection(u32 block, int level,
             break;
     }
 
+    t2fs_put_block(&h, false);
     return res;
 }
 
@@ -173,20 +162,17 @@ static u32 allocate_indirect(u32 *block, int level, u32 count)
 {
     if(level > 0) // block is index block pointer
     {
-        u32 *buffer = idx_block_buffer[level-1];
-
-        if(*block == 0) // Index block unallocated
+        bool new_block = *block == 0;
+        if(new_block) // Index block unallocated
         {
             *block = find_new_block();
             if(*block == 0)
                 return 0;
-            memset(buffer, 0, superblock.block_size); // All invalid pointers
-        }
-        else
-        {
-            if(t2fs_read_block((byte_t*)buffer, *block) != 0)
-                return 0;
         }
+        struct block_handle h; // If new, zeroed: all invalid pointers
+        if(t2fs_get_block(&h, *block, CACHE_KIND_INDEX, new_block) != 0)
+            return 0;
+        u32 *buffer = (u32*)h.data;
 
         u32 level_blocks = 1;
         for(int i=0; i<level-1; i++)
@@ -194,7 +180,7 @@ static u32 allocate_indirect(u32 *block, int level, u32 count)
         u32 ans = allocate_indirect(&buffer[count/level_blocks],
                                     level-1, count % level_blocks);
 
-        if(t2fs_write_block((byte_t*)buffer, *block) != 0)
+        if(t2fs_put_block(&h, true) != 0)
             return 0;
 
         return ans;
@@ -215,9 +201,10 @@ Funct:  Deallocate an indirect block being used.
 Input:  block -> Pointer to index block or where is the block to be deallocated
         level -> Level of indirection (0 = direct; 1 = singly; 2 = doubly; etc)
         count -> Number of blocks before the one to be deallocated (level-wise)
+        root  -> If the blocks are of the root directory, pinned in the cache
 Return: On success, 0 is returned. Otherwise, a negative value is returned.
 -----------------------------------------------------------------------------*/
-static int deallocate_indirect(u32 *block, int level, u32 *count)
+static int deallocate_indirect(u32 *block, int level, u32 *count, bool root)
 {
     if(*block == 0 || *count == 0) // Nothing to be done
         return 0;
@@ -225,6 +212,8 @@ static int deallocate_indirect(u32 *block, int level, u32 *count)
     int res;
     if(level == 0) // block is data block pointer
     {
+        if(root) // May be reused for anything (see allocate_new_block)
+            t2fs_pin_block(*block, false, CACHE_KIND_DIRECTORY);
         res = operate_bitmap(*block, false, 0);
         if(res != 0)
             return res;
@@ -234,34 +223,32 @@ static int deallocate_indirect(u32 *block, int level, u32 *count)
     }
     else // block is index block pointer
     {
-        u32 *buffer = idx_block_buffer[level-1];
-
-        res = t2fs_read_block((byte_t*)buffer, *block);
+        struct block_handle h;
+        res = t2fs_get_block(&h, *block, CACHE_KIND_INDEX, false);
         if(res != 0)
             return res;
+        u32 *buffer = (u32*)h.data;
 
         for(int i=superblock.block_size/sizeof(u32)-1; i>=0 && *count>0; i--)
         {
-            res = deallocate_indirect(&buffer[i], level-1, count);
+            res = deallocate_indirect(&buffer[i], level-1, count, root);
             if(res != 0)
+            {
+                t2fs_put_block(&h, true); // The ones deallocated so far
                 return res;
+            }
         }
 
         if(buffer[0] == 0) // Empty index block
         {
-            operate_bitmap(*block, false, 0);
+            t2fs_put_block(&h, false); // Its contents don't matter anymore
+            res = operate_bitmap(*block, false, 0);
             if(res != 0)
                 return res;
             *block = 0;
+            return 0;
         }
-        else
-        {
-            res = t2fs_write_block((byte_t*)buffer, *block);
-            if(res != 0)
-                return res;
-        }
-
-        return 0;
+        return t2fs_put_block(&h, true);
     }
 }
 
@@ -318,6 +305,25 @@ int write_inode(u32 inode, struct t2fs_inode *data)
 }
 
 
+/*-----------------------------------------------------------------------------
+Funct:  Pin or unpin the sector of the inodes table the given inode is in, so
+            it stays in the cache (see t2fs_pin_sector).
+Input:  inode -> The given inode
+        pin   -> If it's to be pinned (true) or unpinned (false)
+Return: On success, 0 is returned. Otherwise, a negative value is returned.
+-----------------------------------------------------------------------------*/
+int pin_inode(u32 inode, bool pin)
+{
+    if(inode == 0 || inode >= superblock.num_inodes)
+        return -1;
+
+    u32 sector;
+    int byte;
+    calculate_inode_table(inode, &sector, &byte);
+    return t2fs_pin_sector(sector, pin);
+}
+
+
 /*-----------------------------------------------------------------------------
 Funct:  Find a new free inode to use.
 Input:  type -> Type of the file the inode corresponds to
@@ -389,6 +395,9 @@ u32 allocate_new_block(u32 inode)
     if(res != 0)
         return 0;
 
+    if(inode == ROOT_INODE) // Kept in the cache, as the rest of it
+        t2fs_pin_block(ans, true, CACHE_KIND_DIRECTORY);
+
     return ans;
 }
 
@@ -418,7 +427,8 @@ int deallocate_blocks(u32 inode, int count)
     for(int i=NUM_INODE_PTR-1; i>=0 && counter>0; i--)
     {
         int level = MAX(0, i-NUM_DIRECT_PTR+1);
-        res = deallocate_indirect(&inode_s.pointers[i], level, &counter);
+        res = deallocate_indirect(&inode_s.pointers[i], level, &counter,
+                                  inode == ROOT_INODE);
         if(res != 0)
             break;
     }
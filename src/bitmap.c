@@ -0,0 +1,328 @@
+/*****************************************************************************
+ *  Instituto de Informatica - Universidade Federal do Rio Grande do Sul     *
+ *  INF01142 - Sistemas Operacionais I N                                     *
+ *  Task 2 File System (T2FS) 2019/1                                         *
+ *                                                                           *
+ *  Authors: Yuri Jaschek                                                    *
+ *           Giovane Fonseca                                                 *
+ *           Humberto Lentz                                                  *
+ *           Matheus F. Kovaleski                                            *
+ *                                                                           *
+ *****************************************************************************/
+
+/*
+ *   Allocation bitmaps functions
+ *
+ *   Both bitmaps (inodes and blocks) are read into memory when the partition
+ *       is initialized, and kept there instead of in the cache. Bit i of byte
+ *       k is the inode/block 8*k + i, as on disk, so the bitmaps are scanned
+ *       a 64-bit word at a time (little-endian, like the disk structures).
+ *   Changed sectors are only marked dirty, and written back together, through
+ *       the write queue, by t2fs_bitmap_flush (before the cache is flushed).
+ *   Free inodes/blocks are searched next-fit: from where the last allocation
+ *       ended (the rotor), going back to the start only on reaching the end.
+ *       So, the allocated ones aren't scanned again and again. The rotors
+ *       are kept in the superblock, written on a clean unmount.
+ *   So are the counts of free inodes/blocks, changed with the bits. They're
+ *       counted again when the bitmaps are loaded, as the partition may not
+ *       have been unmounted cleanly.
+ *
+ *   Partitions formatted with T2FS_SIGNATURE_V1 kept inode/block n in bit n%8
+ *       of byte n%2048 of its sector, so only the first 256 of each sector
+ *       could be used. Their bitmaps are converted when loaded, and written
+ *       back before the superblock gets the new signature (see init_t2fs).
+ *
+ *   The bitmaps are protected by the mutex of the cache (see t2fs_cache_lock),
+ *       as the flusher thread writes them back as well.
+ */
+
+#include "apidisk.h"
+#include "libt2fs.h"
+#include <stdlib.h>
+#include <string.h>
+
+
+/************************
+ *  Internal variables  *
+ ************************/
+
+static struct bitmap
+{
+    u64 *words;  // The bits, as on disk (NULL if not loaded)
+    u32 bits;    // Number of inodes/blocks
+    u32 offset;  // Sector offset of the bitmap in the partition
+    u32 sectors; // Number of sectors of the bitmap
+    u32 rotor;   // Where the next search starts (never 0)
+    u32 *free;   // Count of free ones, in the superblock
+    bool *dirty; // If each sector has changed since written
+} maps[2]; // Inodes bitmap first, then the blocks bitmap
+
+#define BITS_PER_SECTOR (8 * SECTOR_SIZE)
+
+
+/************************
+ *  Internal functions  *
+ ************************/
+
+/*-----------------------------------------------------------------------------
+Funct:  Convert a bitmap loaded from a T2FS_SIGNATURE_V1 partition to the
+            current layout, marking all its sectors dirty.
+        In the old layout, byte k of a sector held only bit k%8, for the k-th
+            inode/block of the sector.
+Input:  map -> The loaded bitmap
+-----------------------------------------------------------------------------*/
+static void convert_old_layout(struct bitmap *map)
+{
+    byte_t old[SECTOR_SIZE];
+    for(u32 s=0; s<map->sectors; s++)
+    {
+        byte_t *data = (byte_t*)map->words + s * SECTOR_SIZE;
+        memcpy(old, data, SECTOR_SIZE);
+        memset(data, 0, SECTOR_SIZE);
+        for(int k=0; k<SECTOR_SIZE; k++)
+        {
+            if(CHK_BIT(old[k], k % 8))
+                SET_BIT(data[k / 8], k % 8);
+        }
+        map->dirty[s] = true;
+    }
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Read a bitmap of the partition into memory.
+Input:  map     -> Where to load it
+        bits    -> Number of inodes/blocks
+        offset  -> Sector offset of the bitmap in the partition
+        sectors -> Number of sectors of the bitmap
+        rotor   -> Where the search starts (0 or invalid = the start)
+        free    -> Where the count of free ones is kept
+        old     -> If it's in the old layout, to be converted
+Return: On success, 0 is returned. Otherwise, a negative value is returned.
+-----------------------------------------------------------------------------*/
+static int load_map(struct bitmap *map, u32 bits, u32 offset, u32 sectors,
+                    u32 rotor, u32 *free, bool old)
+{
+    map->words = malloc(sectors * SECTOR_SIZE);
+    map->dirty = calloc(sectors, sizeof(bool));
+    if(!map->words || !map->dirty)
+        return -1;
+    map->bits = bits;
+    map->offset = offset;
+    map->sectors = sectors;
+    map->rotor = rotor != 0 && rotor < bits ? rotor : 1U;
+    map->free = free;
+    int res = t2fs_queue_read(superblock.first_sector + offset, sectors,
+                              (byte_t*)map->words);
+    if(res != 0)
+        return res;
+    if(old)
+        convert_old_layout(map);
+
+    // Count the used ones of the valid bits, 0 included (never free)
+    u32 used = 1 - (map->words[0] & 1);
+    for(u32 w=0; w<bits/64; w++)
+        used += __builtin_popcountll(map->words[w]);
+    if(bits % 64 != 0)
+        used += __builtin_popcountll(map->words[bits/64]
+                                     & ((1ULL << (bits % 64)) - 1));
+    *free = bits - used;
+    return 0;
+}
+
+
+static void free_map(struct bitmap *map)
+{
+    free(map->words);
+    free(map->dirty);
+    memset(map, 0, sizeof(*map));
+}
+
+
+/************************
+ *  External functions  *
+ ************************/
+
+/*-----------------------------------------------------------------------------
+Funct:  Read both bitmaps of the partition into memory (see superblock).
+Input:  old_layout -> If the partition has T2FS_SIGNATURE_V1, so the bitmaps
+                      are converted (and then written by t2fs_bitmap_flush)
+Return: On success, 0 is returned. Otherwise, a negative value is returned.
+-----------------------------------------------------------------------------*/
+int t2fs_bitmap_load(bool old_layout)
+{
+    t2fs_bitmap_release();
+    t2fs_cache_lock();
+    int res = load_map(&maps[0], superblock.num_inodes, superblock.ib_offset,
+                       superblock.bb_offset - superblock.ib_offset,
+                       superblock.inode_rotor, &superblock.free_inodes,
+                       old_layout);
+    if(res == 0)
+        res = load_map(&maps[1], superblock.num_blocks, superblock.bb_offset,
+                       superblock.blocks_offset - superblock.bb_offset,
+                       superblock.block_rotor, &superblock.free_blocks,
+                       old_layout);
+    t2fs_cache_unlock();
+    if(res != 0)
+        t2fs_bitmap_release();
+    return res;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Drop the bitmaps from memory, without writing them.
+-----------------------------------------------------------------------------*/
+void t2fs_bitmap_release(void)
+{
+    t2fs_cache_lock();
+    free_map(&maps[0]);
+    free_map(&maps[1]);
+    t2fs_cache_unlock();
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Check if an inode or block is being used.
+Input:  number -> The given inode/block
+        inode  -> If the number is an inode (true) or a block (false)
+Return: If it's not being used, 0 is returned. If it is, a positive value.
+        On error, a negative value is returned.
+-----------------------------------------------------------------------------*/
+int t2fs_bitmap_get(u32 number, bool inode)
+{
+    struct bitmap *map = &maps[inode ? 0 : 1];
+    t2fs_cache_lock();
+    int res = -1;
+    if(map->words && number < map->bits)
+        res = (map->words[number / 64] >> (number % 64)) & 1;
+    t2fs_cache_unlock();
+    return res;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Mark an inode or block as being used or free, counting it. Its
+            sector of the bitmap is written by the next t2fs_bitmap_flush.
+        Once used, the search for free ones continues after it.
+Input:  number -> The given inode/block
+        inode  -> If the number is an inode (true) or a block (false)
+        used   -> If it's being used (set) or free (clear)
+Return: On success, 0 is returned. Otherwise, a negative value is returned.
+-----------------------------------------------------------------------------*/
+int t2fs_bitmap_set(u32 number, bool inode, bool used)
+{
+    struct bitmap *map = &maps[inode ? 0 : 1];
+    t2fs_cache_lock();
+    if(!map->words || number >= map->bits)
+    {
+        t2fs_cache_unlock();
+        return -1;
+    }
+    u64 mask = 1ULL << (number % 64);
+    bool was_used = (map->words[number / 64] & mask) != 0;
+    if(used)
+    {
+        map->words[number / 64] |= mask;
+        map->rotor = number + 1 < map->bits ? number + 1 : 1U;
+    }
+    else
+        map->words[number / 64] &= ~mask;
+    if(number != 0 && was_used && !used) // 0 isn't counted as free
+        (*map->free)++;
+    else if(number != 0 && !was_used && used)
+        (*map->free)--;
+    map->dirty[number / BITS_PER_SECTOR] = true;
+    t2fs_cache_unlock();
+    return 0;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Search for a free inode or block (0 is never free), from the rotor to
+            the end, and then from the start to the rotor.
+        64 of them are checked at once, and the first zero bit of a word is
+            found counting its trailing ones.
+Input:  inode -> What is to be searched: inodes (true) or blocks (false)
+Return: On success, returns the inode/block found (positive integer).
+        If there are no free inodes/blocks, 0 is returned, without searching.
+-----------------------------------------------------------------------------*/
+u32 t2fs_bitmap_find(bool inode)
+{
+    struct bitmap *map = &maps[inode ? 0 : 1];
+    t2fs_cache_lock();
+    u32 ans = 0, num_words = (map->bits + 63) / 64;
+    u32 first = map->rotor / 64;
+    // The word of the rotor is checked twice: from it, and then before it
+    for(u32 k=0; k<=num_words && map->words && *map->free != 0; k++)
+    {
+        u32 w = (first + k) % num_words;
+        u64 free_bits = ~map->words[w];
+        if(k == 0)
+            free_bits &= ~0ULL << (map->rotor % 64);
+        if(w == 0)
+            free_bits &= ~1ULL; // 0 is the invalid inode/block
+        if(w == num_words - 1 && map->bits % 64 != 0) // Past the end
+            free_bits &= (1ULL << (map->bits % 64)) - 1;
+        if(free_bits != 0)
+        {
+            ans = w * 64 + __builtin_ctzll(free_bits);
+            break;
+        }
+    }
+    t2fs_cache_unlock();
+    return ans;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Copy the rotors to the superblock structure, to be written to disk.
+-----------------------------------------------------------------------------*/
+void t2fs_bitmap_to_superblock(void)
+{
+    t2fs_cache_lock();
+    if(maps[0].words)
+    {
+        superblock.inode_rotor = maps[0].rotor;
+        superblock.block_rotor = maps[1].rotor;
+    }
+    t2fs_cache_unlock();
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Write the changed sectors of the bitmaps to disk, through the write
+            queue, each run of adjacent ones at once. The queue isn't
+            flushed (see t2fs_cache_flush).
+Return: On success, 0 is returned. Otherwise, a negative value is returned.
+-----------------------------------------------------------------------------*/
+int t2fs_bitmap_flush(void)
+{
+    int res = 0;
+    t2fs_cache_lock();
+    for(int m=0; m<ARRAY_SIZE(maps); m++)
+    {
+        struct bitmap *map = &maps[m];
+        for(u32 s=0; s<map->sectors; )
+        {
+            if(!map->dirty[s])
+            {
+                s++;
+                continue;
+            }
+            u32 n = 0;
+            while(s + n < map->sectors && map->dirty[s + n])
+                map->dirty[s + n++] = false;
+            byte_t *data = (byte_t*)map->words + s * SECTOR_SIZE;
+            u32 sector = superblock.first_sector + map->offset + s;
+            if(t2fs_queue_write(sector, n, data) != 0)
+            {
+                for(u32 k=0; k<n; k++) // Retried next time
+                    map->dirty[s + k] = true;
+                res = -1;
+            }
+            s += n;
+        }
+    }
+    t2fs_cache_unlock();
+    return res;
+}
@@ -12,12 +12,38 @@
 
 /*
  *   Disk cache management functions
+ *
+ *   The cache replacement policy is chosen by t2fs_cache_policy:
+ *   - LRU: the least recently used entry is evicted.
+ *   - 2Q: entries start in a FIFO queue (A1in), limited to CACHE_A1IN_PCT of
+ *       the cache. When evicted from there, only their sector number is kept
+ *       for a while (A1out). If used again meanwhile, they go to the LRU list
+ *       (Am) instead, where hits move them. So a large sequential scan, whose
+ *       blocks are used once, only replaces the entries in A1in, keeping the
+ *       hot metadata (root directory, inodes table) in Am.
+ *
+ *   Besides, entries can be pinned (see t2fs_pin_sector), up to T2FS_PIN_SIZE
+ *       bytes (a quarter of the cache, if less), so they're never evicted,
+ *       whatever the policy.
+ *
+ *   The capacity can be changed at runtime with cache2_config, which can also
+ *       reserve part of it for metadata: file data is then evicted to make
+ *       room for more file data, before it takes the reserved part.
+ *
+ *   The cache and the write queue may be used by the background flusher
+ *       thread (see flusher.c) as well, so they're protected by a mutex.
  */
 
+#define _GNU_SOURCE // For PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP
+
 #include "apidisk.h"
+#include "apidisk_ext.h"
 #include "libt2fs.h"
+#include "t2fs.h"
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 
 /************************
@@ -26,11 +52,913 @@
 
 static byte_t sector_buffer[SECTOR_SIZE];
 
+// Held while the cache or the write queue is used. Recursive, since the
+//   functions here call the queue's, and each other
+static pthread_mutex_t mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+// Buffers released by t2fs_free_buffer, kept for reuse (up to T2FS_POOL_SIZE
+//   bytes, the others are freed)
+static struct pool_buffer
+{
+    struct pool_buffer *next;
+    u32 size;
+} *pool;
+static u32 pool_bytes;
+
+#define CACHE_HASH_BITS 10 // log2 of the number of hash buckets
+#define CACHE_A1IN_PCT  25 // Max % of the cache for entries used once (2Q)
+#define CACHE_A1OUT_PCT 50 // Max % of the cache remembered after evicted (2Q)
+
+// Cached copy of consecutive disk sectors: a data block or a single sector
+//   (of the inodes table or bitmaps, which aren't in blocks)
+struct cache_entry
+{
+    u32 sector;    // First disk sector (absolute), which identifies the entry
+    u32 count;     // Number of sectors
+    byte_t *data;  // The sectors' contents (NULL if in LIST_A1OUT)
+    bool dirty;    // If data has been written, but not to disk yet
+    u64 dirty_ns;  // When it became dirty (see now_ns)
+    u8 list;       // The list the entry is in
+    u16 pins;      // Number of times pinned (in LIST_PINNED while not 0)
+    u8 kind;       // What the data is, according to enum cache_kind
+    u16 refs;      // Number of handles to it (see t2fs_get_block)
+    u32 uses;      // Number of hits (see t2fs_cache_hot)
+    struct cache_entry *hash_next;   // Next entry in the same hash bucket
+    struct cache_entry *prev, *next; // Neighbours in the list
+};
+
+// Lists of entries, each with the most recent one first
+enum cache_list_id
+{
+    LIST_AM = 0, // Entries used more than once, in LRU order (all of them, if
+                 //   the policy is LRU)
+    LIST_A1IN,   // Entries used only once, in FIFO order (2Q)
+    LIST_PINNED, // Entries pinned, never evicted
+    LIST_A1OUT,  // Entries evicted from LIST_A1IN, without data (2Q)
+};
+
+static struct cache_list
+{
+    struct cache_entry *first, *last;
+    u32 bytes; // Bytes of data the entries have (or had, if in LIST_A1OUT)
+} lists[LIST_A1OUT + 1];
+
+static struct cache_entry *buckets[1 << CACHE_HASH_BITS];
+static int policy = T2FS_CACHE_POLICY;
+static struct cache_counters counters;
+static u32 dirty_bytes; // Bytes of data of the dirty entries
+static u32 data_bytes;  // Bytes of data of the entries of CACHE_KIND_DATA
+static u32 capacity = T2FS_CACHE_SIZE;     // Max bytes of data in the cache
+static u32 meta_reserve = T2FS_CACHE_META; // Bytes only for metadata
+
+
+/************************
+ *  Internal functions  *
+ ************************/
+
+static u32 hash(u32 sector)
+{
+    return (sector * 2654435761U) >> (32 - CACHE_HASH_BITS); // Fibonacci
+}
+
+
+static u64 now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+// Bytes of data in the cache (the entries of LIST_A1OUT have none)
+static u32 cached_bytes(void)
+{
+    return lists[LIST_AM].bytes + lists[LIST_A1IN].bytes
+         + lists[LIST_PINNED].bytes;
+}
+
+
+// Max bytes of the cache pinned
+static u32 pin_limit(void)
+{
+    return MIN(T2FS_PIN_SIZE, capacity / 4);
+}
+
+
+// Free the buffers kept for reuse, giving their memory back
+static void trim_pool(void)
+{
+    while(pool)
+    {
+        struct pool_buffer *p = pool;
+        pool = p->next;
+        free(p);
+    }
+    pool_bytes = 0;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Get the kind of data of a sector outside the data blocks area.
+Input:  sector -> The given sector, relative to the partition
+Return: CACHE_KIND_BITMAP for the bitmaps, CACHE_KIND_INODE otherwise (the
+            superblock is counted with the inodes table).
+-----------------------------------------------------------------------------*/
+static u8 sector_kind(u32 sector)
+{
+    if(sector >= superblock.ib_offset && sector < superblock.blocks_offset)
+        return CACHE_KIND_BITMAP;
+    return CACHE_KIND_INODE;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Mark an entry as dirty or clean, keeping dirty_bytes and the time it
+            became dirty.
+-----------------------------------------------------------------------------*/
+static void set_dirty(struct cache_entry *e, bool dirty)
+{
+    if(dirty && !e->dirty)
+    {
+        e->dirty_ns = now_ns();
+        dirty_bytes += e->count * SECTOR_SIZE;
+    }
+    else if(!dirty && e->dirty)
+        dirty_bytes -= e->count * SECTOR_SIZE;
+    e->dirty = dirty;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Change the kind of data of an entry (a block freed may be reused for
+            something else), keeping data_bytes.
+-----------------------------------------------------------------------------*/
+static void set_kind(struct cache_entry *e, u8 kind)
+{
+    if(e->list != LIST_A1OUT && e->kind != kind)
+    {
+        if(e->kind == CACHE_KIND_DATA)
+            data_bytes -= e->count * SECTOR_SIZE;
+        else if(kind == CACHE_KIND_DATA)
+            data_bytes += e->count * SECTOR_SIZE;
+    }
+    e->kind = kind;
+}
+
+
+static void list_unlink(struct cache_entry *e)
+{
+    struct cache_list *l = &lists[e->list];
+    if(e->prev)
+        e->prev->next = e->next;
+    else
+        l->first = e->next;
+    if(e->next)
+        e->next->prev = e->prev;
+    else
+        l->last = e->prev;
+    l->bytes -= e->count * SECTOR_SIZE;
+    if(e->kind == CACHE_KIND_DATA && e->list != LIST_A1OUT)
+        data_bytes -= e->count * SECTOR_SIZE;
+}
+
+
+static void list_push_front(struct cache_entry *e, u8 list)
+{
+    struct cache_list *l = &lists[list];
+    e->list = list;
+    e->prev = 0; // NULL
+    e->next = l->first;
+    if(l->first)
+        l->first->prev = e;
+    else
+        l->last = e;
+    l->first = e;
+    l->bytes += e->count * SECTOR_SIZE;
+    if(e->kind == CACHE_KIND_DATA && list != LIST_A1OUT)
+        data_bytes += e->count * SECTOR_SIZE;
+}
+
+
+static void list_push_back(struct cache_entry *e, u8 list)
+{
+    struct cache_list *l = &lists[list];
+    e->list = list;
+    e->next = 0; // NULL
+    e->prev = l->last;
+    if(l->last)
+        l->last->next = e;
+    else
+        l->first = e;
+    l->last = e;
+    l->bytes += e->count * SECTOR_SIZE;
+    if(e->kind == CACHE_KIND_DATA && list != LIST_A1OUT)
+        data_bytes += e->count * SECTOR_SIZE;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Find the entry that starts at the given sector, with data or not.
+-----------------------------------------------------------------------------*/
+static struct cache_entry *hash_find(u32 sector)
+{
+    struct cache_entry *e = buckets[hash(sector)];
+    while(e && e->sector != sector)
+        e = e->hash_next;
+    return e;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Find the cache entry that starts at the given sector, making it the
+            most recently used (unless it's in the FIFO queue of 2Q).
+Input:  sector -> First disk sector (absolute) of the entry
+Return: The entry, or NULL if it's not in the cache.
+-----------------------------------------------------------------------------*/
+static struct cache_entry *cache_lookup(u32 sector)
+{
+    struct cache_entry *e = hash_find(sector);
+    if(!e || e->list == LIST_A1OUT) // No data
+    {
+        counters.misses++;
+        return 0; // NULL
+    }
+    counters.hits++;
+    e->uses++;
+    if(e->list == LIST_AM && e != lists[LIST_AM].first)
+    {
+        list_unlink(e);
+        list_push_front(e, LIST_AM);
+    }
+    return e;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Remove an entry from the cache, releasing its memory.
+        If it's dirty, its data is put in the write queue first.
+Return: On success, 0 is returned. Otherwise, a negative value is returned,
+            and the entry is kept.
+-----------------------------------------------------------------------------*/
+static int cache_remove(struct cache_entry *e)
+{
+    if(e->dirty)
+    {
+        if(t2fs_queue_write(e->sector, e->count, e->data) != 0)
+            return -1;
+        counters.writebacks++;
+    }
+    set_dirty(e, false);
+
+    struct cache_entry **p = &buckets[hash(e->sector)];
+    while(*p != e)
+        p = &(*p)->hash_next;
+    *p = e->hash_next;
+    list_unlink(e);
+    t2fs_free_buffer(e->data, e->count * SECTOR_SIZE); // NULL is ok
+    free(e);
+    return 0;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Get the least recently inserted or used entry of a list that has no
+            handles to it, of CACHE_KIND_DATA only if asked so.
+-----------------------------------------------------------------------------*/
+static struct cache_entry *list_victim(u8 list, bool data)
+{
+    struct cache_entry *e = lists[list].last;
+    while(e && (e->refs > 0 || (data && e->kind != CACHE_KIND_DATA)))
+        e = e->prev;
+    return e;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Remove the oldest entries of LIST_A1OUT while it remembers more than
+            its share of the cache.
+-----------------------------------------------------------------------------*/
+static void trim_ghosts(void)
+{
+    u32 max_out = capacity / 100 * CACHE_A1OUT_PCT;
+    while(lists[LIST_A1OUT].bytes > max_out)
+        cache_remove(lists[LIST_A1OUT].last);
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Evict an entry, according to the replacement policy. With 2Q, an entry
+            evicted from LIST_A1IN is kept in LIST_A1OUT, without its data.
+Input:  data -> If only entries of CACHE_KIND_DATA may be evicted
+Return: On success, 0 is returned. Otherwise, a negative value is returned.
+-----------------------------------------------------------------------------*/
+static int cache_evict(bool data)
+{
+    struct cache_entry *e = list_victim(LIST_AM, data);
+    struct cache_entry *in = list_victim(LIST_A1IN, data);
+    if(in && (lists[LIST_A1IN].bytes > capacity / 100 * CACHE_A1IN_PCT || !e))
+    {
+        e = in;
+        if(e->dirty)
+        {
+            if(t2fs_queue_write(e->sector, e->count, e->data) != 0)
+                return -1;
+            counters.writebacks++;
+        }
+        set_dirty(e, false);
+        list_unlink(e);
+        t2fs_free_buffer(e->data, e->count * SECTOR_SIZE);
+        e->data = 0; // NULL
+        list_push_front(e, LIST_A1OUT);
+        trim_ghosts();
+    }
+    else if(!e || cache_remove(e) != 0)
+        return -1;
+    counters.evictions++;
+    return 0;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Create an entry for the given sectors, evicting others to make room.
+            Its data is left for the caller to fill.
+        With 2Q, it goes to LIST_A1IN, unless it's been evicted from there
+            recently (it's in LIST_A1OUT), when it goes to LIST_AM.
+        File data beyond the part of the cache not reserved for metadata
+            evicts file data only.
+Input:  sector -> First disk sector (absolute), not in the cache
+        count  -> Number of sectors
+        kind   -> What the data is, according to enum cache_kind
+Return: The new entry, or NULL if it doesn't fit in the cache, there's no
+            memory for it or a dirty entry couldn't be written back.
+-----------------------------------------------------------------------------*/
+static struct cache_entry *cache_insert(u32 sector, u32 count, u8 kind)
+{
+    u32 size = count * SECTOR_SIZE;
+    bool data = kind == CACHE_KIND_DATA;
+    if(!T2FS_USE_CACHE || size + pin_limit() > capacity
+       || (data && size > capacity - meta_reserve))
+        return 0; // NULL
+
+    u8 list = policy == CACHE_POLICY_2Q ? LIST_A1IN : LIST_AM;
+    struct cache_entry *ghost = hash_find(sector); // Only in LIST_A1OUT
+    if(ghost)
+    {
+        counters.ghost_hits++;
+        list = LIST_AM;
+        cache_remove(ghost); // No data to write
+    }
+    while(cached_bytes() + size > capacity
+          || (data && data_bytes + size > capacity - meta_reserve))
+    {
+        bool only_data = data && data_bytes + size > capacity - meta_reserve;
+        if(cache_evict(only_data) != 0)
+            return 0; // NULL
+    }
+
+    struct cache_entry *e = malloc(sizeof(*e));
+    if(!e)
+        return 0; // NULL
+    e->data = t2fs_alloc_buffer(size);
+    if(!e->data)
+    {
+        free(e);
+        return 0; // NULL
+    }
+    e->sector = sector;
+    e->count = count;
+    e->dirty = false;
+    e->pins = 0;
+    e->kind = kind;
+    e->refs = 0;
+    e->uses = 0;
+    e->hash_next = buckets[hash(sector)];
+    buckets[hash(sector)] = e;
+    list_push_front(e, list);
+    return e;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Read part of consecutive sectors, from the cache if they're there.
+        Otherwise, all of them are read (seeing pending writes) and cached.
+Input:  sector -> First disk sector (absolute)
+        count  -> Number of sectors (1 or a block)
+        data   -> Where to store the data read
+        offset -> Offset in the sectors where the desired data is
+        size   -> Number of bytes to read (only less than all if count is 1)
+        kind   -> What the data is, according to enum cache_kind
+Return: On success, 0 is returned. Otherwise, a negative value is returned.
+-----------------------------------------------------------------------------*/
+static int cache_read(u32 sector, u32 count, byte_t *data, int offset,
+                      int size, u8 kind)
+{
+    struct cache_entry *e = cache_lookup(sector);
+    if(e)
+        set_kind(e, kind);
+    else
+    {
+        e = cache_insert(sector, count, kind);
+        byte_t *dst = e ? e->data : size < SECTOR_SIZE ? sector_buffer : data;
+        if(t2fs_queue_read(sector, count, dst) != 0)
+        {
+            if(e)
+                cache_remove(e); // Not dirty
+            return -1;
+        }
+        if(!e) // Not cached
+        {
+            if(dst != data)
+                memcpy(data, dst + offset, size);
+            return 0;
+        }
+    }
+    memcpy(data, e->data + offset, size);
+    return 0;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Write whole consecutive sectors to their cache entry (created if
+            needed), which becomes dirty, to be written to disk when evicted
+            or by t2fs_cache_flush. If they can't be cached, they're queued.
+Input:  sector -> First disk sector (absolute)
+        count  -> Number of sectors (1 or a block)
+        data   -> Where the data is (count * SECTOR_SIZE bytes)
+        kind   -> What the data is, according to enum cache_kind
+Return: On success, 0 is returned. Otherwise, a negative value is returned.
+-----------------------------------------------------------------------------*/
+static int cache_write(u32 sector, u32 count, byte_t *data, u8 kind)
+{
+    struct cache_entry *e = cache_lookup(sector);
+    if(e)
+        set_kind(e, kind);
+    else
+        e = cache_insert(sector, count, kind);
+    if(!e)
+        return t2fs_queue_write(sector, count, data); // Written later, sorted
+    memcpy(e->data, data, count * SECTOR_SIZE);
+    set_dirty(e, true);
+    return 0;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Write part of a sector to its cache entry (created if needed), which
+            becomes dirty. The sector is read first only if the write is
+            partial and it isn't in the cache or in the write queue. If it
+            can't be cached, it's queued.
+Input:  sector -> Disk sector (absolute)
+        data   -> Where the data is
+        offset -> Offset in the sector where the data is to be written
+        size   -> Number of bytes to write
+        kind   -> What the data is, according to enum cache_kind
+Return: On success, 0 is returned. Otherwise, a negative value is returned.
+-----------------------------------------------------------------------------*/
+static int cache_patch(u32 sector, byte_t *data, int offset, int size,
+                       u8 kind)
+{
+    // The data is patched into the cached image of the sector, so the disk
+    //   is only read if it's not resident (nor pending in the write queue)
+    struct cache_entry *e = cache_lookup(sector);
+    byte_t *image = sector_buffer;
+    if(e)
+    {
+        image = e->data;
+        set_kind(e, kind);
+    }
+    else
+    {
+        e = cache_insert(sector, 1, kind);
+        if(e)
+            image = e->data;
+        if(size < SECTOR_SIZE && t2fs_queue_read(sector, 1, image) != 0)
+        {
+            if(e)
+                cache_remove(e);
+            return -1;
+        }
+    }
+    memcpy(image + offset, data, size);
+    if(!e) // Not cached
+        return t2fs_queue_write(sector, 1, image); // Written later, sorted
+    set_dirty(e, true);
+    return 0;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Insert an entry to be read in advance, unless it's already cached.
+        It's held (as by a handle) until read by prefetch_submit, so the
+            next ones of the batch don't evict it, reusing its data buffer
+            before the disk fills it. When nothing else can be evicted, they
+            just aren't inserted.
+Input:  sector -> First disk sector (absolute)
+        count  -> Number of sectors (1 or a block)
+        kind   -> What the data is, according to enum cache_kind
+Return: The new entry, or NULL if already cached or it couldn't be inserted.
+-----------------------------------------------------------------------------*/
+static struct cache_entry *prefetch_entry(u32 sector, u32 count, u8 kind)
+{
+    struct cache_entry *e = hash_find(sector);
+    if(e && e->list != LIST_A1OUT) // Already cached
+        return 0; // NULL
+    if(e)
+        cache_remove(e); // Not a ghost hit: it isn't being used yet
+    e = cache_insert(sector, count, kind);
+    if(e)
+        e->refs++;
+    return e;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Read the entries inserted by prefetch_entry, all submitted at once,
+            and release them. The ones the disk fails to read are removed.
+Input:  reqs    -> The read requests, one for each entry, into their data
+        entries -> The entries
+        nreqs   -> Number of entries
+-----------------------------------------------------------------------------*/
+static void prefetch_submit(struct disk_request *reqs,
+                            struct cache_entry **entries, int nreqs)
+{
+    if(nreqs == 0)
+        return;
+
+    bool failed = submit_sectors(reqs, nreqs) != 0;
+    for(int i=0; i<nreqs; i++)
+    {
+        entries[i]->refs--;
+        if(failed && reqs[i].result != 0)
+            cache_remove(entries[i]); // Not dirty
+        else // Writes still in the queue
+            t2fs_queue_overlay(reqs[i].sector, reqs[i].count, reqs[i].buffer);
+    }
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Read blocks into the cache (see t2fs_prefetch_blocks).
+-----------------------------------------------------------------------------*/
+static void prefetch(u32 *blocks, int count)
+{
+    struct disk_request reqs[T2FS_MAX_BATCH];
+    struct cache_entry *entries[T2FS_MAX_BATCH];
+    // The capacity may have changed since the caller checked it
+    int max = MIN((capacity - meta_reserve) / 8 / superblock.block_size,
+                  (u32)T2FS_MAX_BATCH);
+    int nreqs = 0;
+    for(int i=0; i<count && nreqs<max; i++)
+    {
+        if(blocks[i] == 0 || blocks[i] >= superblock.num_blocks)
+            continue;
+        u32 sector = superblock.first_sector + superblock.blocks_offset
+                   + blocks[i] * superblock.sectors_per_block;
+        struct cache_entry *e = prefetch_entry(sector,
+                                    superblock.sectors_per_block,
+                                    CACHE_KIND_DATA);
+        if(!e)
+            continue;
+        reqs[nreqs].sector = sector;
+        reqs[nreqs].count = superblock.sectors_per_block;
+        reqs[nreqs].buffer = e->data; // Straight into the cache
+        reqs[nreqs].write = 0;
+        entries[nreqs++] = e;
+    }
+    prefetch_submit(reqs, entries, nreqs);
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Pin or unpin consecutive sectors, read into the cache if needed.
+        Pins are counted: the entry is unpinned when unpinned as many times as
+            it was pinned. Then, it's taken as used more than once.
+Input:  sector -> First disk sector (absolute)
+        count  -> Number of sectors (1 or a block)
+        pin    -> If the sectors are to be pinned (true) or unpinned (false)
+        kind   -> What the data is, according to enum cache_kind
+Return: On success, 0 is returned. Otherwise (e.g. the limit of pinned bytes
+            would be exceeded), a negative value is returned.
+-----------------------------------------------------------------------------*/
+static int cache_pin(u32 sector, u32 count, bool pin, u8 kind)
+{
+    struct cache_entry *e = hash_find(sector);
+    if(!pin)
+    {
+        if(!e || e->pins == 0)
+            return -1;
+        if(--e->pins == 0)
+        {
+            list_unlink(e);
+            list_push_front(e, LIST_AM);
+        }
+        return 0;
+    }
+
+    if(e && e->pins == UINT16_MAX)
+        return -1;
+    if((!e || e->pins == 0)
+       && lists[LIST_PINNED].bytes + count * SECTOR_SIZE > pin_limit())
+        return -1;
+    if(e && e->list == LIST_A1OUT)
+    {
+        cache_remove(e); // No data to write
+        e = 0; // NULL
+    }
+    if(!e)
+    {
+        e = cache_insert(sector, count, kind);
+        if(!e)
+            return -1;
+        if(t2fs_queue_read(sector, count, e->data) != 0)
+        {
+            cache_remove(e); // Not dirty
+            return -1;
+        }
+    }
+    if(e->pins++ == 0)
+    {
+        list_unlink(e);
+        list_push_front(e, LIST_PINNED);
+    }
+    return 0;
+}
+
+
+static int compare_sector(const void *a, const void *b)
+{
+    u32 x = (*(struct cache_entry**)a)->sector;
+    u32 y = (*(struct cache_entry**)b)->sector;
+    return x < y ? -1 : x > y;
+}
+
+
+static int compare_dirty_ns(const void *a, const void *b)
+{
+    u64 x = (*(struct cache_entry**)a)->dirty_ns;
+    u64 y = (*(struct cache_entry**)b)->dirty_ns;
+    return x < y ? -1 : x > y;
+}
+
+
+static int compare_hot(const void *a, const void *b)
+{
+    const struct cache_entry *x = *(struct cache_entry**)a;
+    const struct cache_entry *y = *(struct cache_entry**)b;
+    bool x_data = x->kind == CACHE_KIND_DATA;
+    bool y_data = y->kind == CACHE_KIND_DATA;
+    if(x_data != y_data)
+        return x_data ? 1 : -1; // Metadata first
+    return x->uses > y->uses ? -1 : x->uses < y->uses; // Most used first
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Write single dirty entries to disk, all submitted at once. The ones
+            written become clean.
+Input:  reqs    -> The write requests, one for each entry
+        entries -> The entries
+        nreqs   -> Number of entries
+Return: On success, 0 is returned. Otherwise, a negative value is returned.
+-----------------------------------------------------------------------------*/
+static int submit_entries(struct disk_request *reqs,
+                          struct cache_entry **entries, int nreqs)
+{
+    if(nreqs == 0)
+        return 0;
+    int res = submit_sectors(reqs, nreqs) != 0 ? -1 : 0;
+    for(int i=0; i<nreqs; i++)
+    {
+        if(reqs[i].result == 0)
+        {
+            set_dirty(entries[i], false);
+            counters.writebacks++;
+        }
+    }
+    return res;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Write dirty entries to disk straight from their data, without the
+            queue. Each run of entries contiguous on disk (up to
+            T2FS_MAX_BATCH of them) is written with a single vectored request,
+            and the entries alone are submitted in batches.
+        Pending writes of the same sectors are older, so they're dropped.
+        The entries written become clean.
+Input:  dirty -> The entries, sorted by sector
+        n     -> Number of entries
+Return: On success, 0 is returned. Otherwise, a negative value is returned.
+-----------------------------------------------------------------------------*/
+static int write_entries(struct cache_entry **dirty, u32 n)
+{
+    struct iovec iov[T2FS_MAX_BATCH];
+    struct disk_request reqs[T2FS_MAX_BATCH];
+    struct cache_entry *singles[T2FS_MAX_BATCH];
+    int nreqs = 0, res = 0;
+    for(u32 i=0; i<n; )
+    {
+        struct cache_entry **run = &dirty[i];
+        u32 len = 1, count = run[0]->count;
+        while(i + len < n && len < T2FS_MAX_BATCH
+              && run[len]->sector == run[0]->sector + count)
+            count += run[len++]->count;
+        t2fs_queue_cancel(run[0]->sector, count);
+        i += len;
+
+        if(len == 1)
+        {
+            reqs[nreqs].sector = run[0]->sector;
+            reqs[nreqs].count = count;
+            reqs[nreqs].buffer = run[0]->data;
+            reqs[nreqs].write = 1;
+            singles[nreqs++] = run[0];
+            if(nreqs == T2FS_MAX_BATCH)
+            {
+                if(submit_entries(reqs, singles, nreqs) != 0)
+                    res = -1;
+                nreqs = 0;
+            }
+            continue;
+        }
+
+        for(u32 k=0; k<len; k++)
+        {
+            iov[k].iov_base = run[k]->data;
+            iov[k].iov_len = run[k]->count * SECTOR_SIZE;
+        }
+        if(writev_sectors(run[0]->sector, iov, len) != 0)
+        {
+            res = -1;
+            continue;
+        }
+        for(u32 k=0; k<len; k++)
+        {
+            set_dirty(run[k], false);
+            counters.writebacks++;
+        }
+    }
+    if(submit_entries(reqs, singles, nreqs) != 0)
+        res = -1;
+    return res;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Write dirty entries back (see t2fs_cache_writeback). The ones with
+            handles to them may be being changed, so they're left for later.
+-----------------------------------------------------------------------------*/
+static int writeback(u64 age_ns, u32 max_dirty)
+{
+    u32 num_dirty = 0;
+    for(int l=LIST_AM; l<=LIST_PINNED; l++)
+    {
+        for(struct cache_entry *e = lists[l].first; e; e = e->next)
+            num_dirty += e->dirty && e->refs == 0;
+    }
+
+    int res = 0;
+    if(num_dirty > 0)
+    {
+        struct cache_entry **dirty = malloc(num_dirty * sizeof(*dirty));
+        if(!dirty)
+            return -1;
+        u32 n = 0;
+        for(int l=LIST_AM; l<=LIST_PINNED; l++)
+        {
+            for(struct cache_entry *e = lists[l].first; e; e = e->next)
+            {
+                if(e->dirty && e->refs == 0)
+                    dirty[n++] = e;
+            }
+        }
+
+        // The oldest ones, as many as needed
+        qsort(dirty, n, sizeof(*dirty), compare_dirty_ns);
+        u64 now = now_ns();
+        u32 remaining = dirty_bytes, chosen = 0;
+        while(chosen < n && (now - dirty[chosen]->dirty_ns >= age_ns
+                             || remaining > max_dirty))
+        {
+            remaining -= dirty[chosen]->count * SECTOR_SIZE;
+            chosen++;
+        }
+
+        qsort(dirty, chosen, sizeof(*dirty), compare_sector);
+        res = write_entries(dirty, chosen);
+        free(dirty);
+    }
+    if(t2fs_queue_flush() != 0)
+        res = -1;
+    return res;
+}
+
 
 /************************
  *  External functions  *
  ************************/
 
+/*-----------------------------------------------------------------------------
+Funct:  Get a buffer for disk transfers from the pool. If its size is a
+            multiple of DISK_ALIGN, it's aligned to DISK_ALIGN, so O_DIRECT
+            transfers from/to it need no intermediate copy (smaller transfers
+            need one anyway).
+        Buffers are reused from the pool when there's one of the same size.
+            It keeps few of them (T2FS_POOL_SIZE bytes), so the memory of
+            the entries evicted goes back to the system.
+Input:  size -> Size of the buffer, in bytes
+Return: On success, the buffer is returned. Otherwise, NULL is returned.
+-----------------------------------------------------------------------------*/
+byte_t *t2fs_alloc_buffer(u32 size)
+{
+    size = MAX(size, sizeof(struct pool_buffer));
+    pthread_mutex_lock(&mutex);
+    for(struct pool_buffer **p = &pool; *p; p = &(*p)->next)
+    {
+        if((*p)->size == size) // Found one to be reused
+        {
+            struct pool_buffer *buffer = *p;
+            *p = buffer->next;
+            pool_bytes -= size;
+            pthread_mutex_unlock(&mutex);
+            return (byte_t*)buffer;
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+    void *buffer;
+    size_t align = size % DISK_ALIGN == 0 ? DISK_ALIGN : 2*sizeof(void*);
+    if(posix_memalign(&buffer, align, size) != 0)
+        return 0; // NULL
+    return buffer;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Give back to the pool a buffer got by t2fs_alloc_buffer, or free it
+            if the pool is full.
+Input:  buffer -> The buffer (NULL is accepted and ignored)
+        size   -> Size the buffer was allocated with
+-----------------------------------------------------------------------------*/
+void t2fs_free_buffer(byte_t *buffer, u32 size)
+{
+    if(!buffer)
+        return;
+    struct pool_buffer *p = (struct pool_buffer*)buffer;
+    p->size = MAX(size, sizeof(struct pool_buffer));
+    pthread_mutex_lock(&mutex);
+    if(pool_bytes + p->size > T2FS_POOL_SIZE)
+    {
+        pthread_mutex_unlock(&mutex);
+        free(p);
+        return;
+    }
+    p->next = pool;
+    pool = p;
+    pool_bytes += p->size;
+    pthread_mutex_unlock(&mutex);
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Pin or unpin the given sector in the cache (see cache_pin). While
+            pinned, it's never evicted.
+Input:  sector -> The given sector, relative to the partition
+        pin    -> If the sector is to be pinned (true) or unpinned (false)
+Return: On success, 0 is returned. Otherwise, a negative value is returned.
+-----------------------------------------------------------------------------*/
+int t2fs_pin_sector(u32 sector, bool pin)
+{
+    if(sector >= superblock.num_sectors)
+        return -1;
+    pthread_mutex_lock(&mutex);
+    int res = cache_pin(superblock.first_sector + sector, 1, pin,
+                        sector_kind(sector));
+    pthread_mutex_unlock(&mutex);
+    return res;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Pin or unpin the given block in the cache (see cache_pin). While
+            pinned, it's never evicted.
+Input:  block -> The given block, relative to the partition
+        pin   -> If the block is to be pinned (true) or unpinned (false)
+        kind  -> What the block is, according to enum cache_kind
+Return: On success, 0 is returned. Otherwise, a negative value is returned.
+-----------------------------------------------------------------------------*/
+int t2fs_pin_block(u32 block, bool pin, u8 kind)
+{
+    if(block >= superblock.num_blocks)
+        return -1;
+    u32 sector = superblock.first_sector + superblock.blocks_offset
+               + block * superblock.sectors_per_block;
+    pthread_mutex_lock(&mutex);
+    int res = cache_pin(sector, superblock.sectors_per_block, pin, kind);
+    pthread_mutex_unlock(&mutex);
+    return res;
+}
+
+
 /*-----------------------------------------------------------------------------
 Funct:  Read data from the given disk sector to the given data buffer.
 Input:  data   -> Where to store the data read
@@ -45,17 +973,19 @@ int t2fs_read_sector(byte_t *data, u32 sector, int offset, int size)
         return -1;
     if(offset + size > SECTOR_SIZE)
         return -1;
+    u8 kind = sector_kind(sector);
     sector += superblock.first_sector;
-    int res = read_sector(sector, sector_buffer);
-    if(res != 0)
-        return -abs(res);
-    memcpy(data, sector_buffer + offset, size);
-    return 0;
+    pthread_mutex_lock(&mutex);
+    int res = cache_read(sector, 1, data, offset, size, kind);
+    pthread_mutex_unlock(&mutex);
+    return res;
 }
 
 
 /*-----------------------------------------------------------------------------
 Funct:  Write the given data to the given disk sector.
+        The sector is read first only if the write is partial and the sector
+            isn't in the cache or in the write queue.
 Input:  data   -> Where the data is
         sector -> The given sector to be written, relative to the partition
         offset -> Offset in the sector where the desired data is to be written
@@ -68,15 +998,13 @@ int t2fs_write_sector(byte_t *data, u32 sector, int offset, int size)
         return -1;
     if(offset + size > SECTOR_SIZE)
         return -1;
+    u8 kind = sector_kind(sector);
     sector += superblock.first_sector;
-    int res = read_sector(sector, sector_buffer);
-    if(res != 0)
-        return -abs(res);
-    memcpy(sector_buffer + offset, data, size);
-    res = write_sector(sector, sector_buffer);
-    if(res != 0)
-        return -abs(res);
-    return 0;
+    pthread_mutex_lock(&mutex);
+    int res = cache_patch(sector, data, offset, size, kind);
+    pthread_mutex_unlock(&mutex);
+    t2fs_flusher_throttle();
+    return res;
 }
 
 
@@ -84,22 +1012,21 @@ int t2fs_write_sector(byte_t *data, u32 sector, int offset, int size)
 Funct:  Read the given disk block to the given data buffer.
 Input:  data  -> Where to store the data read
         block -> The given block to be read, relative to the partition
+        kind  -> What the block is, according to enum cache_kind
 Return: On success, 0 is returned. Otherwise, a negative value is returned.
 -----------------------------------------------------------------------------*/
-int t2fs_read_block(byte_t *data, u32 block)
+int t2fs_read_block(byte_t *data, u32 block, u8 kind)
 {
     if(block >= superblock.num_blocks)
         return -1;
     u32 sector = superblock.first_sector + superblock.blocks_offset
                + block * superblock.sectors_per_block;
-    for(u8 i=0; i<superblock.sectors_per_block; i++)
-    {
-        int res = read_sector(sector+i, data);
-        if(res != 0)
-            return -abs(res);
-        data += superblock.sector_size;
-    }
-    return 0;
+    // The whole block in a single disk request, if not cached
+    pthread_mutex_lock(&mutex);
+    int res = cache_read(sector, superblock.sectors_per_block, data, 0,
+                         superblock.block_size, kind);
+    pthread_mutex_unlock(&mutex);
+    return res;
 }
 
 
@@ -107,20 +1034,437 @@ int t2fs_read_block(byte_t *data, u32 block)
 Funct:  Write the given data to the given block.
 Input:  data  -> Where the data is
         block -> The given block to be written, relative to the partition
+        kind  -> What the block is, according to enum cache_kind
+Return: On success, 0 is returned. Otherwise, a negative value is returned.
+-----------------------------------------------------------------------------*/
+int t2fs_write_block(byte_t *data, u32 block, u8 kind)
+{
+    if(block >= superblock.num_blocks)
+        return -1;
+    u32 sector = superblock.first_sector + superblock.blocks_offset
+               + block * superblock.sectors_per_block;
+    // The whole block in a single disk request, later, sorted
+    pthread_mutex_lock(&mutex);
+    int res = cache_write(sector, superblock.sectors_per_block, data, kind);
+    pthread_mutex_unlock(&mutex);
+    t2fs_flusher_throttle();
+    return res;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Get a handle to the given block, whose data is the block's contents
+            in the cache itself, so it can be read and changed without copies.
+            While there are handles to it, it's never evicted.
+        If the block can't be cached, the handle has a copy of it instead.
+        Every handle must be released with t2fs_put_block.
+Input:  h     -> The handle to be filled
+        block -> The given block, relative to the partition
+        kind  -> What the block is, according to enum cache_kind
+        zero  -> If the block is new: its contents are zeros, not read, and
+                 it's taken as changed
 Return: On success, 0 is returned. Otherwise, a negative value is returned.
 -----------------------------------------------------------------------------*/
-int t2fs_write_block(byte_t *data, u32 block)
+int t2fs_get_block(struct block_handle *h, u32 block, u8 kind, bool zero)
 {
     if(block >= superblock.num_blocks)
         return -1;
     u32 sector = superblock.first_sector + superblock.blocks_offset
                + block * superblock.sectors_per_block;
-    for(u8 i=0; i<superblock.sectors_per_block; i++)
+    h->block = block;
+    pthread_mutex_lock(&mutex);
+    struct cache_entry *e = cache_lookup(sector);
+    if(e)
+        set_kind(e, kind);
+    else
+    {
+        e = cache_insert(sector, superblock.sectors_per_block, kind);
+        if(e && !zero && t2fs_queue_read(sector, e->count, e->data) != 0)
+        {
+            cache_remove(e); // Not dirty
+            pthread_mutex_unlock(&mutex);
+            return -1;
+        }
+    }
+    if(e)
+    {
+        e->refs++;
+        if(zero)
+        {
+            memset(e->data, 0, superblock.block_size);
+            set_dirty(e, true);
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+
+    h->entry = e;
+    if(e)
+    {
+        h->data = e->data;
+        return 0;
+    }
+    h->data = t2fs_alloc_buffer(superblock.block_size); // Not cached
+    if(!h->data)
+        return -1;
+    if(zero)
+        memset(h->data, 0, superblock.block_size);
+    else if(t2fs_read_block(h->data, block, kind) != 0)
+    {
+        t2fs_free_buffer(h->data, superblock.block_size);
+        return -1;
+    }
+    return 0;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Release a handle got by t2fs_get_block, which can't be used anymore.
+Input:  h     -> The handle
+        dirty -> If the block was changed through it (must be true if it was
+                 got with zero)
+Return: On success, 0 is returned. Otherwise, a negative value is returned.
+-----------------------------------------------------------------------------*/
+int t2fs_put_block(struct block_handle *h, bool dirty)
+{
+    int res = 0;
+    if(h->entry)
+    {
+        pthread_mutex_lock(&mutex);
+        h->entry->refs--;
+        if(dirty)
+            set_dirty(h->entry, true);
+        pthread_mutex_unlock(&mutex);
+    }
+    else // A copy
     {
-        int res = write_sector(sector+i, data);
-        if(res != 0)
-            return -abs(res);
-        data += superblock.sector_size;
+        u32 sector = superblock.first_sector + superblock.blocks_offset
+                   + h->block * superblock.sectors_per_block;
+        pthread_mutex_lock(&mutex);
+        // Cached meanwhile (see t2fs_cache_warm): the copy is newer
+        struct cache_entry *e = hash_find(sector);
+        if(dirty && e && e->list != LIST_A1OUT)
+        {
+            memcpy(e->data, h->data, superblock.block_size);
+            set_dirty(e, true);
+        }
+        else if(dirty)
+            res = t2fs_queue_write(sector, superblock.sectors_per_block,
+                                   h->data);
+        pthread_mutex_unlock(&mutex);
+        t2fs_free_buffer(h->data, superblock.block_size);
     }
+    h->data = 0; // NULL
+    if(dirty)
+        t2fs_flusher_throttle();
+    return res;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Read blocks into the cache in advance, all submitted to the disk at
+            once. Blocks already cached (or 0, unallocated) are skipped.
+        Being just a hint, errors are ignored. The blocks are taken as not
+            used yet: they go to LIST_A1IN, with 2Q, even if remembered in
+            LIST_A1OUT.
+        Only as many as fit in an eighth of the part of the cache file data
+            can take (see cache2_config) are read.
+Input:  blocks -> The given blocks, relative to the partition
+        count  -> Number of blocks
+-----------------------------------------------------------------------------*/
+void t2fs_prefetch_blocks(u32 *blocks, int count)
+{
+    pthread_mutex_lock(&mutex);
+    prefetch(blocks, count);
+    pthread_mutex_unlock(&mutex);
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Read the given entries of a warm list into the cache, all submitted
+            to the disk at once (see warmup.c). The ones already cached, or
+            that don't fit with the others of the batch, are skipped. Errors
+            are ignored.
+        They're taken as used before: with 2Q, they go to LIST_AM, at its
+            end, so anything used meanwhile is kept before them.
+Input:  list  -> The entries, with sectors relative to the partition
+        count -> Number of entries (at most T2FS_MAX_BATCH are read)
+-----------------------------------------------------------------------------*/
+void t2fs_cache_warm(struct t2fs_warm_entry *list, int count)
+{
+    struct disk_request reqs[T2FS_MAX_BATCH];
+    struct cache_entry *entries[T2FS_MAX_BATCH];
+    int nreqs = 0;
+    pthread_mutex_lock(&mutex);
+    for(int i=0; i<count && nreqs<T2FS_MAX_BATCH; i++)
+    {
+        // Blocks are in the data area; before it, single sectors
+        u32 n = list[i].sector < superblock.blocks_offset
+              ? 1 : superblock.sectors_per_block;
+        u32 sector = superblock.first_sector + list[i].sector;
+        struct cache_entry *e = prefetch_entry(sector, n, list[i].kind);
+        if(!e)
+            continue;
+        list_unlink(e);
+        list_push_back(e, LIST_AM);
+        reqs[nreqs].sector = sector;
+        reqs[nreqs].count = n;
+        reqs[nreqs].buffer = e->data; // Straight into the cache
+        reqs[nreqs].write = 0;
+        entries[nreqs++] = e;
+    }
+    prefetch_submit(reqs, entries, nreqs);
+    pthread_mutex_unlock(&mutex);
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Make the warm list of what is in the cache: the hottest entries
+            first, metadata before file data, and then the most used.
+Input:  list -> Where to store the entries, with sectors relative to the
+                    partition
+        max  -> Max number of entries to store
+Return: The number of entries stored.
+-----------------------------------------------------------------------------*/
+u32 t2fs_cache_hot(struct t2fs_warm_entry *list, u32 max)
+{
+    pthread_mutex_lock(&mutex);
+    u32 n = 0;
+    for(int l=LIST_AM; l<=LIST_PINNED; l++) // LIST_A1OUT has no data
+        for(struct cache_entry *e = lists[l].first; e; e = e->next)
+            n++;
+    struct cache_entry **hot = malloc(MAX(n, 1U) * sizeof(*hot));
+    if(!hot)
+    {
+        pthread_mutex_unlock(&mutex);
+        return 0;
+    }
+    n = 0;
+    for(int l=LIST_AM; l<=LIST_PINNED; l++)
+        for(struct cache_entry *e = lists[l].first; e; e = e->next)
+            hot[n++] = e;
+    qsort(hot, n, sizeof(*hot), compare_hot);
+
+    n = MIN(n, max);
+    for(u32 i=0; i<n; i++)
+    {
+        list[i].sector = hot[i]->sector - superblock.first_sector;
+        list[i].kind = hot[i]->kind;
+        memset(list[i].reserved, 0, sizeof(list[i].reserved));
+    }
+    free(hot);
+    pthread_mutex_unlock(&mutex);
+    return n;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Write dirty cache entries to disk, in ascending sector order, through
+            the write queue, which is flushed as well: the ones dirty for at
+            least the given time, and the oldest others while more than the
+            given number of bytes would be left dirty.
+        The entries stay in the cache, clean.
+Input:  age_ns    -> Min time dirty, in ns (UINT64_MAX = none is old enough)
+        max_dirty -> Max number of bytes left dirty
+Return: On success, 0 is returned. Otherwise, a negative value is returned.
+-----------------------------------------------------------------------------*/
+int t2fs_cache_writeback(u64 age_ns, u32 max_dirty)
+{
+    pthread_mutex_lock(&mutex);
+    int res = writeback(age_ns, max_dirty);
+    pthread_mutex_unlock(&mutex);
+    return res;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Write all dirty cache entries to disk (see t2fs_cache_writeback).
+Return: On success, 0 is returned. Otherwise, a negative value is returned.
+-----------------------------------------------------------------------------*/
+int t2fs_cache_flush(void)
+{
+    return t2fs_cache_writeback(0, 0);
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Get the number of bytes of dirty data in the cache.
+-----------------------------------------------------------------------------*/
+u32 t2fs_cache_dirty(void)
+{
+    pthread_mutex_lock(&mutex);
+    u32 bytes = dirty_bytes;
+    pthread_mutex_unlock(&mutex);
+    return bytes;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Drop everything in the cache (e.g. when the partition is formatted),
+            including dirty data, which isn't written. The buffers kept for
+            reuse are freed too, as the block size may change.
+-----------------------------------------------------------------------------*/
+void t2fs_cache_invalidate(void)
+{
+    pthread_mutex_lock(&mutex);
+    for(int l=LIST_AM; l<=LIST_A1OUT; l++)
+    {
+        for(struct cache_entry *e = lists[l].first; e; e = e->next)
+            set_dirty(e, false);
+        while(lists[l].first)
+            cache_remove(lists[l].first);
+    }
+    trim_pool();
+    pthread_mutex_unlock(&mutex);
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Change the replacement policy of the cache. The cached data is kept.
+Input:  new_policy -> The policy, according to enum cache_policy
+Return: On success, the previous policy is returned. Otherwise, a negative
+            value is returned.
+-----------------------------------------------------------------------------*/
+int t2fs_cache_policy(int new_policy)
+{
+    if(new_policy != CACHE_POLICY_LRU && new_policy != CACHE_POLICY_2Q)
+        return -1;
+    pthread_mutex_lock(&mutex);
+    if(new_policy == CACHE_POLICY_LRU)
+    {
+        // Entries used only once become the least recently used
+        while(lists[LIST_A1IN].first)
+        {
+            struct cache_entry *e = lists[LIST_A1IN].first;
+            list_unlink(e);
+            list_push_back(e, LIST_AM);
+        }
+        while(lists[LIST_A1OUT].first)
+            cache_remove(lists[LIST_A1OUT].first);
+    }
+    int previous = policy;
+    policy = new_policy;
+    pthread_mutex_unlock(&mutex);
+    return previous;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Change the capacity of the cache and the part of it reserved for
+            metadata (see t2fs.h), evicting entries (and writing the dirty
+            ones back) and freeing their buffers if it shrinks.
+        The pinned entries can't be evicted, so the capacity can't be less
+            than 4 times their size.
+Input:  new_capacity -> Max bytes of data in the cache
+        meta_size    -> Bytes of it file data can't take
+Return: On success, 0 is returned. Otherwise, a non-zero value is returned.
+-----------------------------------------------------------------------------*/
+int cache2_config(u32 new_capacity, u32 meta_size)
+{
+    if(meta_size > new_capacity)
+        return -1;
+    pthread_mutex_lock(&mutex);
+    if(lists[LIST_PINNED].bytes > new_capacity / 4)
+    {
+        pthread_mutex_unlock(&mutex);
+        return -1;
+    }
+    bool shrink = new_capacity < capacity;
+    capacity = new_capacity;
+    meta_reserve = meta_size;
+
+    int res = 0;
+    while(res == 0 && data_bytes > capacity - meta_reserve)
+        res = cache_evict(true);
+    while(res == 0 && cached_bytes() > capacity)
+        res = cache_evict(false);
+    trim_ghosts();
+    if(shrink)
+        trim_pool();
+    pthread_mutex_unlock(&mutex);
+    return res;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Get the capacity of the cache, in bytes (see cache2_config).
+-----------------------------------------------------------------------------*/
+u32 t2fs_cache_capacity(void)
+{
+    pthread_mutex_lock(&mutex);
+    u32 bytes = capacity;
+    pthread_mutex_unlock(&mutex);
+    return bytes;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Get the bytes of the cache file data can take: the capacity less the
+            part reserved for metadata (see cache2_config).
+-----------------------------------------------------------------------------*/
+u32 t2fs_cache_data_capacity(void)
+{
+    pthread_mutex_lock(&mutex);
+    u32 bytes = capacity - meta_reserve;
+    pthread_mutex_unlock(&mutex);
+    return bytes;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Fill the statistics of the cache (see t2fs.h). The counters are the
+            ones since the start or the last t2fs_cache_reset_counters.
+Input:  stats -> Where to store the statistics
+Return: On success, 0 is returned. Otherwise, a non-zero value is returned.
+-----------------------------------------------------------------------------*/
+int t2fs_cache_stats(CACHESTAT2 *stats)
+{
+    if(!stats)
+        return -1;
+    memset(stats, 0, sizeof(*stats));
+    pthread_mutex_lock(&mutex);
+    stats->hits = counters.hits;
+    stats->misses = counters.misses;
+    stats->ghost_hits = counters.ghost_hits;
+    stats->evictions = counters.evictions;
+    stats->writebacks = counters.writebacks;
+    stats->dirty_bytes = dirty_bytes;
+    stats->pinned_bytes = lists[LIST_PINNED].bytes;
+    stats->capacity = capacity;
+    stats->meta_reserve = meta_reserve;
+    for(int l=LIST_AM; l<=LIST_PINNED; l++) // LIST_A1OUT has no data
+    {
+        for(struct cache_entry *e = lists[l].first; e; e = e->next)
+        {
+            stats->entries++;
+            stats->dirty += e->dirty;
+            stats->kind_entries[e->kind]++;
+            stats->kind_bytes[e->kind] += e->count * SECTOR_SIZE;
+        }
+    }
+    pthread_mutex_unlock(&mutex);
     return 0;
 }
+
+
+void t2fs_cache_reset_counters(void)
+{
+    pthread_mutex_lock(&mutex);
+    memset(&counters, 0, sizeof(counters));
+    pthread_mutex_unlock(&mutex);
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Hold or release the mutex of the cache and the write queue. Used by
+            queue.c, whose functions are called from elsewhere as well.
+-----------------------------------------------------------------------------*/
+void t2fs_cache_lock(void)
+{
+    pthread_mutex_lock(&mutex);
+}
+
+
+void t2fs_cache_unlock(void)
+{
+    pthread_mutex_unlock(&mutex);
+}
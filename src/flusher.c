@@ -0,0 +1,175 @@
+/*****************************************************************************
+ *  Instituto de Informatica - Universidade Federal do Rio Grande do Sul     *
+ *  INF01142 - Sistemas Operacionais I N                                     *
+ *  Task 2 File System (T2FS) 2019/1                                         *
+ *                                                                           *
+ *  Authors: Yuri Jaschek                                                    *
+ *           Giovane Fonseca                                                 *
+ *           Humberto Lentz                                                  *
+ *           Matheus F. Kovaleski                                            *
+ *                                                                           *
+ *****************************************************************************/
+
+/*
+ *   Background flusher functions
+ *
+ *   The flusher is a thread that writes dirty cached data back to disk when
+ *       it has been dirty for longer than a given age, or when more than a
+ *       given ratio of the cache is dirty. So, less data is lost if the
+ *       process crashes, and sync2 has less to write.
+ *   If the dirty data grows past a limit anyway, the writers write the
+ *       oldest of it back themselves (throttling), before going on.
+ */
+
+#include "libt2fs.h"
+#include "t2fs.h"
+#include <pthread.h>
+#include <time.h>
+
+
+/************************
+ *  Internal variables  *
+ ************************/
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake; // Signaled to stop the thread or when too dirty
+static pthread_t thread;
+static bool running; // If the thread has been started (and not stopped)
+
+static u64 age_ns;    // Max time data stays dirty
+static u32 ratio_pct; // % of the cache dirty that wakes the thread up
+static u32 limit_pct; // % of the cache dirty that makes writers throttle
+
+
+/************************
+ *  Internal functions  *
+ ************************/
+
+/*-----------------------------------------------------------------------------
+Funct:  Main function of the flusher thread. Every half of the age (at most a
+            second), or when woken up, write back the data dirty for too long
+            and the oldest while too much is dirty.
+        The thresholds may change meanwhile (see t2fs_flusher_start), so
+            they're read again on every pass.
+-----------------------------------------------------------------------------*/
+static void *flusher_main(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&lock);
+    while(running)
+    {
+        u64 interval = MIN(age_ns / 2, 1000000000ULL);
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        u64 deadline = ts.tv_nsec + interval;
+        ts.tv_sec += deadline / 1000000000ULL;
+        ts.tv_nsec = deadline % 1000000000ULL;
+        pthread_cond_timedwait(&wake, &lock, &ts);
+        if(!running)
+            break;
+
+        // The capacity of the cache may change (see cache2_config)
+        u32 ratio = t2fs_cache_capacity() / 100 * ratio_pct;
+        u64 age = age_ns;
+        pthread_mutex_unlock(&lock); // Writers aren't held meanwhile
+        t2fs_bitmap_flush(); // Written along, by the same queue flush
+        t2fs_cache_writeback(age, ratio); // Retried next time
+        pthread_mutex_lock(&lock);
+    }
+    pthread_mutex_unlock(&lock);
+    return 0; // NULL
+}
+
+
+/************************
+ *  External functions  *
+ ************************/
+
+/*-----------------------------------------------------------------------------
+Funct:  Start the flusher thread, or change its thresholds if already started.
+Input:  age_ms      -> Max time data stays dirty, in ms (at least 1)
+        dirty_ratio -> % of the cache dirty that wakes the flusher up
+        dirty_limit -> % of the cache dirty that makes writers throttle (not
+                       less than dirty_ratio)
+Return: On success, 0 is returned. Otherwise, a negative value is returned.
+-----------------------------------------------------------------------------*/
+int t2fs_flusher_start(u32 age_ms, u32 dirty_ratio, u32 dirty_limit)
+{
+    if(age_ms == 0 || dirty_ratio > dirty_limit || dirty_limit > 100)
+        return -1;
+
+    pthread_mutex_lock(&lock);
+    age_ns = age_ms * 1000000ULL;
+    ratio_pct = dirty_ratio;
+    limit_pct = dirty_limit;
+    if(running) // Only the thresholds change
+    {
+        pthread_cond_signal(&wake); // Not to sleep for the old age anymore
+        pthread_mutex_unlock(&lock);
+        return 0;
+    }
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&wake, &attr);
+    pthread_condattr_destroy(&attr);
+
+    running = true;
+    if(pthread_create(&thread, 0, flusher_main, 0) != 0)
+    {
+        running = false;
+        pthread_cond_destroy(&wake);
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Stop the flusher thread, waiting for it to finish. The dirty data is
+            left in the cache.
+-----------------------------------------------------------------------------*/
+void t2fs_flusher_stop(void)
+{
+    pthread_mutex_lock(&lock);
+    if(!running)
+    {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    running = false;
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&lock);
+
+    pthread_join(thread, 0);
+    pthread_cond_destroy(&wake);
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Called after data is written to the cache. If the flusher is running,
+            wake it up if too much of the cache is dirty, and, past the limit,
+            write the oldest dirty data back before returning.
+        Must not be called holding the mutex of the cache.
+-----------------------------------------------------------------------------*/
+void t2fs_flusher_throttle(void)
+{
+    pthread_mutex_lock(&lock);
+    if(!running)
+    {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    u32 dirty = t2fs_cache_dirty(), capacity = t2fs_cache_capacity();
+    u32 ratio = capacity / 100 * ratio_pct;
+    if(dirty > ratio)
+        pthread_cond_signal(&wake);
+    bool throttle = dirty > capacity / 100 * limit_pct;
+    pthread_mutex_unlock(&lock);
+
+    if(throttle) // The writer pays for it
+        t2fs_cache_writeback(UINT64_MAX, ratio);
+}
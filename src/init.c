@@ -15,7 +15,9 @@
  */
 
 #include "apidisk.h"
+#include "apidisk_ext.h"
 #include "libt2fs.h"
+#include "t2fs.h"
 #include <stdlib.h>
 #include <string.h>
 
@@ -27,6 +29,7 @@
 static struct t2fs_mbr mbr; // Structure to hold the MBR
 static bool init_done; // If we can work with the partition already or not
 static byte_t sector_buffer[SECTOR_SIZE]; // Auxiliary space to hold a sector
+static bool exit_registered; // If flush_at_exit has been registered
 
 
 /************************
@@ -35,6 +38,7 @@ static byte_t sector_buffer[SECTOR_SIZE]; // Auxiliary space to hold a sector
 
 /*-----------------------------------------------------------------------------
 Funct:  Initialize the MBR structure, reading it from "t2fs_disk.dat".
+        The disk is opened here and kept opened for the process lifetime.
         After the function succeeds once, it will always return success.
 Return: On success, 0 is returned. Otherwise, a non-zero value is returned.
 -----------------------------------------------------------------------------*/
@@ -51,7 +55,14 @@ static int init_mbr()
     if(sizeof(struct t2fs_inode) > SECTOR_SIZE)
         return -1;
 
-    res = read_sector(0, sector_buffer); // MBR is in sector 0
+    res = set_disk_flags(T2FS_DIRECT_IO ? DISK_DIRECT : 0);
+    if(res != 0)
+        return res;
+    res = open_disk();
+    if(res != 0)
+        return res;
+
+    res = read_sectors(0, 1, sector_buffer); // MBR is in sector 0
     if(res != 0)
         return res;
 
@@ -60,6 +71,90 @@ static int init_mbr()
 }
 
 
+/*-----------------------------------------------------------------------------
+Funct:  Write everything still in memory to disk, when the process exits
+            without having called umount2.
+-----------------------------------------------------------------------------*/
+static void flush_at_exit(void)
+{
+    if(!init_done || t2fs_bitmap_flush() != 0 || t2fs_cache_flush() != 0)
+        return;
+    t2fs_warmup_save(); // A clean exit: the cache can be warmed next time
+    init_write_superblock();
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Pin a block of the root directory. To be used with
+            iterate_inode_blocks.
+Return: A positive value, to iterate over all blocks.
+-----------------------------------------------------------------------------*/
+static int pin_root_block(u32 block, va_list args)
+{
+    (void)args;
+    t2fs_pin_block(block, true, CACHE_KIND_DIRECTORY);
+    return 1;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Pin in the cache the metadata used by almost every operation: the
+            root inode and the root directory blocks (the superblock and the
+            bitmaps are always in memory). Opened files' inodes are pinned
+            while opened (see get_new_desc).
+        Pinning is limited (T2FS_PIN_SIZE), and it's only an optimization, so
+            what can't be pinned is just left out.
+-----------------------------------------------------------------------------*/
+static void pin_metadata()
+{
+    pin_inode(ROOT_INODE, true);
+    iterate_inode_blocks(ROOT_INODE, pin_root_block);
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Write the superblock structure to the partition, with the current
+            rotors of the bitmaps (see bitmap.c), through the write queue.
+Return: On success, 0 is returned. Otherwise, a non-zero value is returned.
+-----------------------------------------------------------------------------*/
+static int write_superblock()
+{
+    t2fs_bitmap_to_superblock();
+
+    memset(sector_buffer, 0, SECTOR_SIZE);
+    memcpy(sector_buffer, &superblock, sizeof(superblock));
+    int res = t2fs_queue_write(superblock.first_sector, 1, sector_buffer);
+    if(res != 0)
+        return res;
+    return t2fs_queue_flush();
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Finish converting a partition with T2FS_SIGNATURE_V1, whose bitmaps
+            were converted when loaded (see bitmap.c). They're written to the
+            disk before the superblock gets the current signature, so the
+            partition has either the old or the new layout, never a mix.
+Return: On success, 0 is returned. Otherwise, a non-zero value is returned.
+-----------------------------------------------------------------------------*/
+static int upgrade_layout()
+{
+    int res = t2fs_bitmap_flush();
+    if(res == 0)
+        res = t2fs_queue_flush();
+    if(res == 0)
+        res = flush_disk();
+    if(res != 0)
+        return res;
+
+    strcpy(superblock.signature, T2FS_SIGNATURE);
+    res = write_superblock();
+    if(res != 0)
+        return res;
+    return flush_disk();
+}
+
+
 /*-----------------------------------------------------------------------------
 Funct:  Calculate the maximum number of logical blocks that can fit in a
             partition, together with its bitmap of appropriate size, by doing
@@ -93,31 +188,45 @@ static u32 calculate_num_blocks(u32 sectors_per_block, u32 sectors_available)
 Funct:  Setup structures for the file system on the disk.
         The given superblock must be already initialized and valid.
         The structures offsets will be those in the superblock.
+        If sparse, the whole partition is discarded instead of having the
+            structures zeroed, so the host doesn't store its empty parts.
+            If the disk can't discard, the structures are zeroed as usual.
 Input:  sblock -> Pointer to the superblock with the partition information
+        sparse -> If the partition should be discarded
 Return: On success, 0 is returned. Otherwise, a non-zero value is returned.
 -----------------------------------------------------------------------------*/
-static int setup_structures(struct t2fs_superblock *sblock)
+static int setup_structures(struct t2fs_superblock *sblock, bool sparse)
 {
     int res;
 
     memset(sector_buffer, 0, SECTOR_SIZE); // Clean sector for the structures
-    u32 first = sblock->first_sector + sblock->it_offset;
+    u32 first = sblock->first_sector + sblock->wl_offset;
     u32 last  = sblock->first_sector + sblock->blocks_offset; // Not included
 
+    if(sparse)
+    {
+        res = t2fs_queue_flush(); // Nothing pending written after discarding
+        if(res != 0)
+            return res;
+        if(discard_sectors(sblock->first_sector, sblock->num_sectors) == 0)
+            first = last; // Already zeros
+    }
+
     for(u32 i = first; i < last; ++i)
     {
-        res = write_sector(i, sector_buffer);
+        // Through the write queue, so they're written in long runs
+        res = t2fs_queue_write(i, 1, sector_buffer);
         if(res != 0)
             return res;
     }
 
     memcpy(sector_buffer, sblock, sizeof(*sblock));
     // Write the superblock, the rest of the sector filled with 0
-    res = write_sector(sblock->first_sector, sector_buffer);
+    res = t2fs_queue_write(sblock->first_sector, 1, sector_buffer);
     if(res != 0)
         return res;
 
-    return 0;
+    return t2fs_queue_flush(); // Formatting is written at once
 }
 
 
@@ -128,14 +237,16 @@ static int setup_structures(struct t2fs_superblock *sblock)
 /*-----------------------------------------------------------------------------
 Funct:  Format the specified partition of "t2fs_disk.dat".
         It reserves space for each of the internal structures needed, namely:
-            superblock, inodes table, inodes bitmap and blocks bitmap.
+            superblock, warm list (see warmup.c), inodes table, inodes bitmap
+            and blocks bitmap.
         All the necessary information is stored in the partition's superblock,
             and the internal structures are initialized accordingly.
         The number of inodes, which DOES NOT CHANGE unless the partition is
             formatted again, will be defined in terms of sectors reserved for
             the inodes table, which will be roughly 1% of the total number of
             sectors in the partition.
-        The partition must have a size of at least 4 sectors + 1 logical block.
+        The partition must have a size of at least 4 sectors + 2 logical
+            blocks + the warm list (T2FS_WARM_SECTORS).
         The root directory ('/') is not created in this function, it should be
             created afterwards, using inode 1.
         After formatting, init_t2fs must be called at some point before any
@@ -143,12 +254,20 @@ Funct:  Format the specified partition of "t2fs_disk.dat".
 Input:  sectors_per_block -> Number of disk sectors in a logical block,
                              between 1 and 128 (inclusive)
         partition         -> Which partition to be formatted
+        sparse            -> If the partition should be discarded, so that
+                             "t2fs_disk.dat" is sparse (see setup_structures)
 Return: On success, 0 is returned. Otherwise, a non-zero value is returned.
 -----------------------------------------------------------------------------*/
-int init_format(int sectors_per_block, int partition)
+int init_format(int sectors_per_block, int partition, bool sparse)
 {
     int res;
 
+    t2fs_warmup_stop(); // Not to read the old layout into the cache
+    t2fs_flusher_stop(); // Not to write cached data over the new layout
+    t2fs_cache_invalidate(); // The layout may change
+    t2fs_bitmap_release();
+    t2fs_queue_forget(); // Freed blocks of the old layout
+
     res = init_mbr(); // Make sure MBR is initialized
     if(res != 0)
         return res;
@@ -163,10 +282,13 @@ int init_format(int sectors_per_block, int partition)
         return -1;
 
     u32 num_sectors = last_sector - first_sector + 1;
-    if(num_sectors < 2U*sectors_per_block + 4U) // Minimum number of sectors
+    // Minimum number of sectors
+    if(num_sectors < 2U*sectors_per_block + 4U + T2FS_WARM_SECTORS)
         return -1;
 
-    u32 remaining = num_sectors - 1; // Remaining sectors. Superblock reserved
+    // Remaining sectors. Superblock and warm list reserved
+    u32 remaining = num_sectors - 1 - T2FS_WARM_SECTORS;
+    u32 it_offset = 1U + T2FS_WARM_SECTORS;
 
     // Sectors for inodes table, defined as a % of the total number of sectors
     u32 it_sectors = (INODES_SECTOR_PCT / 100.0) * remaining;
@@ -194,14 +316,18 @@ int init_format(int sectors_per_block, int partition)
         .num_sectors = num_sectors,
         .num_blocks = num_blocks,
         .num_inodes = num_inodes,
-        .it_offset = 1U,
-        .ib_offset = 1U + it_sectors,
-        .bb_offset = 1U + it_sectors + ib_sectors,
-        .blocks_offset = 1U + it_sectors + ib_sectors + bb_sectors,
+        .it_offset = it_offset,
+        .ib_offset = it_offset + it_sectors,
+        .bb_offset = it_offset + it_sectors + ib_sectors,
+        .blocks_offset = it_offset + it_sectors + ib_sectors + bb_sectors,
+        .wl_offset = 1U,
+        .wl_sectors = T2FS_WARM_SECTORS,
+        .free_inodes = num_inodes - 1, // Inode 0 is invalid
+        .free_blocks = num_blocks - 1, // Block 0 is invalid
     };
 
     // Will initialize the structures on the disk
-    res = setup_structures(&sblock);
+    res = setup_structures(&sblock, sparse);
     if(res != 0)
         return res;
 
@@ -213,6 +339,8 @@ int init_format(int sectors_per_block, int partition)
 /*-----------------------------------------------------------------------------
 Funct:  Check if the T2FS partition superblock is valid for us to work with.
         This function is also used to initialize the superblock structure.
+        A partition formatted with the old bitmap layout (T2FS_SIGNATURE_V1)
+            is converted to the current one.
         Unless the partition is formatted, subsequent calls to this function
             after a success will always return with success.
 Input:  partition -> Which partition to be initialized
@@ -233,32 +361,75 @@ int init_t2fs(int partition)
         return -1;
 
     // Read superblock sector
-    res = read_sector(mbr.ptable[partition].first_sector, sector_buffer);
+    res = read_sectors(mbr.ptable[partition].first_sector, 1, sector_buffer);
     if(res != 0)
         return res;
 
     // Copy the superblock
     superblock = *((struct t2fs_superblock*)sector_buffer);
-    // Make sure it's our "magic string"
-    if(strcmp(superblock.signature, T2FS_SIGNATURE) != 0)
+    // Make sure it's our "magic string", the current or the old one
+    bool old_layout = strcmp(superblock.signature, T2FS_SIGNATURE_V1) == 0;
+    if(!old_layout && strcmp(superblock.signature, T2FS_SIGNATURE) != 0)
         return -1;
 
-    // Allocate buffer memory
-    free(block_buffer); // free(NULL) is ok
-    block_buffer = malloc(superblock.block_size);
-    if(!block_buffer)
-        return -1;
-
-    for(int i=0; i<NUM_INDIRECT_LVL; i++)
+    // Dirty cached data is written at exit, if umount2 isn't called
+    if(!exit_registered)
     {
-        free(idx_block_buffer[i]);
-        idx_block_buffer[i] = malloc(superblock.block_size);
-        if(!idx_block_buffer[i])
+        if(atexit(flush_at_exit) != 0)
             return -1;
+        exit_registered = true;
+    }
+
+    res = t2fs_bitmap_load(old_layout);
+    if(res == 0 && old_layout) // Converted once, here
+        res = upgrade_layout();
+    if(res != 0)
+    {
+        t2fs_bitmap_release();
+        return res;
     }
 
+    pin_metadata();
+    if(T2FS_WARMUP) // Also an optimization: errors ignored
+        t2fs_warmup_start();
+    if(T2FS_FLUSHER) // Not needed for the file system to work: errors ignored
+        t2fs_flusher_start(T2FS_DIRTY_AGE, T2FS_DIRTY_RATIO, T2FS_DIRTY_LIMIT);
+
     // Start at root directory
     cwd_inode = ROOT_INODE;
     init_done = true;
     return 0;
 }
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Write the superblock of the initialized partition, with the current
+            rotors of the bitmaps (see bitmap.c). To be called on a clean
+            unmount, after everything else has been written.
+Return: On success, 0 is returned. Otherwise, a non-zero value is returned.
+-----------------------------------------------------------------------------*/
+int init_write_superblock(void)
+{
+    if(!init_done)
+        return -1;
+    return write_superblock();
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Release the partition: stop the threads, drop the cache and close
+            the disk. Everything must have been written to disk already.
+        The next call to init_t2fs initializes everything again, reading the
+            MBR and the superblock from the disk.
+Return: On success, 0 is returned. Otherwise, a non-zero value is returned.
+-----------------------------------------------------------------------------*/
+int init_unmount(void)
+{
+    t2fs_warmup_stop();
+    t2fs_flusher_stop();
+    t2fs_cache_invalidate();
+    t2fs_bitmap_release();
+    init_done = false;
+    mbr.sector_size = 0; // The disk may be changed meanwhile
+    return close_disk();
+}
@@ -27,6 +27,8 @@
 static struct t2fs_descriptor table[1+T2FS_MAX_FILES_OPENED];
 static int fd_counter;
 
+#define READAHEAD_MIN 4 // Initial number of blocks read ahead
+
 
 /************************
  *  Internal functions  *
@@ -36,19 +38,21 @@ static u32 get_nth_block_indirect(u32 *block, int level, int count)
 {
     if(level > 0) // block is index block pointer
     {
-        u32 *buffer = idx_block_buffer[level-1];
-
         if(*block == 0) // Index block unallocated
             return 0;
-        if(t2fs_read_block((byte_t*)buffer, *block) != 0)
+        struct block_handle h;
+        if(t2fs_get_block(&h, *block, CACHE_KIND_INDEX, false) != 0)
             return 0;
+        u32 *buffer = (u32*)h.data;
 
         u32 level_blocks = 1;
         for(int i=0; i<level-1; i++)
             level_blocks *= superblock.block_size / sizeof(u32);
 
-        return get_nth_block_indirect(&buffer[count/level_blocks],
-                                      level-1, count % level_blocks);
+        u32 ans = get_nth_block_indirect(&buffer[count/level_blocks],
+                                         level-1, count % level_blocks);
+        t2fs_put_block(&h, false);
+        return ans;
     }
     else // block is data block pointer
     {
@@ -117,6 +121,12 @@ struct t2fs_descriptor *get_new_desc(u32 inode, u8 type)
     table[pos].type = type;
     table[pos].curr_pos = 0;
     table[pos].inode = inode;
+    table[pos].ra_pos = 0; // Reading from the beginning is sequential
+    table[pos].ra_next = 0;
+    table[pos].ra_window = 0;
+    // In the cache while opened (if there's room). The inode's sector may be
+    //   pinned for others too, so it's only unpinned if pinned here
+    table[pos].pinned = pin_inode(inode, true) == 0;
     return &table[pos];
 }
 
@@ -145,6 +155,8 @@ Input:  fd -> Pointer to the descriptor, which must have been got by a call to
 -----------------------------------------------------------------------------*/
 void release_desc(struct t2fs_descriptor *fd)
 {
+    if(fd->id != 0 && fd->pinned)
+        pin_inode(fd->inode, false);
     memset(fd, 0, sizeof(*fd));
 }
 
@@ -166,6 +178,16 @@ void close_all_inode(u32 inode)
 }
 
 
+/*-----------------------------------------------------------------------------
+Funct:  Close all files and directories opened.
+-----------------------------------------------------------------------------*/
+void close_all_desc(void)
+{
+    for(int i=0; i<=T2FS_MAX_FILES_OPENED; i++)
+        release_desc(&table[i]);
+}
+
+
 /*-----------------------------------------------------------------------------
 Funct:  Adjust the current position of all file descriptors with the given
             inode for it to not be greater than the given limit.
@@ -183,6 +205,75 @@ void adjust_pointer_all(u32 inode, u32 limit)
 }
 
 
+/*-----------------------------------------------------------------------------
+Funct:  Detect sequential reads of the given descriptor and read the next
+            blocks of the file ahead, into the cache, before they're needed.
+        The number of blocks read ahead starts at READAHEAD_MIN and doubles,
+            up to T2FS_READAHEAD, each time the reads get halfway through the
+            blocks read ahead. A read not starting where the previous one
+            ended resets it.
+        Must be called before reading size bytes from the current position.
+Input:  fd   -> The descriptor
+        size -> Number of bytes about to be read
+-----------------------------------------------------------------------------*/
+void t2fs_readahead(struct t2fs_descriptor *fd, u32 size)
+{
+    bool sequential = fd->curr_pos == fd->ra_pos;
+    fd->ra_pos = fd->curr_pos + size;
+    if(!sequential) // Random access
+    {
+        fd->ra_next = 0;
+        fd->ra_window = 0;
+        return;
+    }
+
+    // At most an eighth of the cache file data can take (see
+    //   t2fs_prefetch_blocks)
+    u32 max_window = MIN(T2FS_READAHEAD, t2fs_cache_data_capacity() / 8
+                                         / superblock.block_size);
+    u32 first = fd->curr_pos / superblock.block_size;
+    u32 last = (fd->curr_pos + size - 1) / superblock.block_size;
+    if(max_window == 0 || fd->ra_next > last + fd->ra_window / 2)
+        return; // Far enough ahead
+
+    fd->ra_window = fd->ra_window ? MIN(fd->ra_window * 2, max_window)
+                                  : MIN(READAHEAD_MIN, max_window);
+    struct t2fs_inode inode_s;
+    if(read_inode(fd->inode, &inode_s) != 0)
+        return;
+    u32 file_blocks = (inode_s.bytes_size + superblock.block_size - 1)
+                    / superblock.block_size;
+    u32 start = MAX(fd->ra_next, first);
+    u32 end = MIN(last + 1 + fd->ra_window, file_blocks);
+    end = MIN(end, start + 2 * max_window); // The rest of large reads later
+    fd->ra_next = MAX(end, fd->ra_next);
+
+    // Mapping them reads the index blocks needed (through the cache). The
+    //   blocks before a new index block are read first, as they're usually
+    //   before it on disk as well
+    u32 blocks[MAX(T2FS_READAHEAD, 1)];
+    u32 count = 0, ptrs = superblock.block_size / sizeof(u32);
+    for(u32 n = start; n < end; n++)
+    {
+        bool new_index = n >= NUM_DIRECT_PTR
+                      && (n - NUM_DIRECT_PTR) % ptrs == 0;
+        if(count > 0 && new_index)
+        {
+            t2fs_prefetch_blocks(blocks, count);
+            count = 0;
+        }
+        blocks[count++] = get_nth_block(&inode_s, n);
+        if(count == max_window)
+        {
+            t2fs_prefetch_blocks(blocks, count);
+            count = 0;
+        }
+    }
+    if(count > 0)
+        t2fs_prefetch_blocks(blocks, count);
+}
+
+
 /*-----------------------------------------------------------------------------
 Funct:  Read from or write to a file.
 Input:  buffer   -> Where to put data read or to get data from if writing
@@ -198,6 +289,8 @@ int t2fs_rw_data(byte_t *buffer, u32 inode, u32 curr_pos, u32 size, bool wr)
     struct t2fs_inode inode_s;
     if(read_inode(inode, &inode_s) != 0)
         return -1;
+    u8 kind = inode_s.type == FILETYPE_DIRECTORY ? CACHE_KIND_DIRECTORY
+                                                 : CACHE_KIND_DATA;
 
     u32 rem = size;
     while(rem > 0)
@@ -213,8 +306,11 @@ int t2fs_rw_data(byte_t *buffer, u32 inode, u32 curr_pos, u32 size, bool wr)
         u32 block = get_nth_block(&inode_s, curr_pos / superblock.block_size);
         if(block == 0 && !wr)
             break;
+        // Not read if all of it is to be written, or if it's new (zeroed)
+        bool zero = wr && bytes == superblock.block_size;
         if(block == 0) // Writing: Need to allocate a new block
         {
+            zero = true;
             block = allocate_new_block(inode);
             if(block == 0)
                 break;
@@ -223,16 +319,15 @@ int t2fs_rw_data(byte_t *buffer, u32 inode, u32 curr_pos, u32 size, bool wr)
                 break;
         }
 
-        if(t2fs_read_block(block_buffer, block) != 0)
+        struct block_handle h;
+        if(t2fs_get_block(&h, block, kind, zero) != 0)
             break;
         if(wr) // Write operation
-        {
-            memcpy(block_buffer+offset, buffer, bytes);
-            if(t2fs_write_block(block_buffer, block) != 0)
-                break;
-        }
+            memcpy(h.data+offset, buffer, bytes);
         else // Read operation
-            memcpy(buffer, block_buffer+offset, bytes);
+            memcpy(buffer, h.data+offset, bytes);
+        if(t2fs_put_block(&h, wr) != 0)
+            break;
 
         rem -= bytes;
         buffer += bytes;
@@ -157,13 +157,16 @@ start: // When a link is found
             {
                 if(max_link-- == 0)
                     return ans;
-                if(t2fs_read_block(block_buffer, file.pointers[0]) != 0)
+                struct block_handle h;
+                if(t2fs_get_block(&h, file.pointers[0], CACHE_KIND_DATA,
+                                  false) != 0)
                     return ans;
                 char aux[T2FS_PATH_MAX];
                 strcpy(aux, next); // aux = next
                 // path = contents(file) + "/" + next
                 snprintf(path, MIN(T2FS_PATH_MAX, superblock.block_size),
-                         "%s/%s", (char*)block_buffer, aux);
+                         "%s/%s", (char*)h.data, aux);
+                t2fs_put_block(&h, false);
                 goto start;
             }
         }
@@ -181,11 +184,14 @@ start: // When a link is found
         {
             if(max_link-- == 0)
                 return ans;
-            if(t2fs_read_block(block_buffer, file.pointers[0]) != 0)
+            struct block_handle h;
+            if(t2fs_get_block(&h, file.pointers[0], CACHE_KIND_DATA,
+                              false) != 0)
                 return ans;
             // path = contents(file)
-            strncpy(path, (char*)block_buffer,
+            strncpy(path, (char*)h.data,
                     MIN(T2FS_PATH_MAX, superblock.block_size));
+            t2fs_put_block(&h, false);
             goto start;
         }
     }
@@ -0,0 +1,421 @@
+/*****************************************************************************
+ *  Instituto de Informatica - Universidade Federal do Rio Grande do Sul     *
+ *  INF01142 - Sistemas Operacionais I N                                     *
+ *  Task 2 File System (T2FS) 2019/1                                         *
+ *                                                                           *
+ *  Authors: Yuri Jaschek                                                    *
+ *           Giovane Fonseca                                                 *
+ *           Humberto Lentz                                                  *
+ *           Matheus F. Kovaleski                                            *
+ *                                                                           *
+ *****************************************************************************/
+
+/*
+ *   Sector write queue functions (elevator scheduling)
+ *
+ *   Sector writes are held in the queue, sorted by sector number, and written
+ *       to disk all at once when it gets full or when t2fs_queue_flush is
+ *       called (by t2fs_cache_flush). Adjacent sectors are then merged into
+ *       single multi-sector requests, and all of them submitted together, in
+ *       ascending order. Reads see the pending writes.
+ *
+ *   Freed sectors are collected as well, merged into extents, and discarded
+ *       (see discard_sectors) after the writes, if large enough.
+ *
+ *   The queue is protected by the mutex of the cache (see t2fs_cache_lock).
+ */
+
+#include "apidisk.h"
+#include "apidisk_ext.h"
+#include "libt2fs.h"
+#include <string.h>
+
+
+/************************
+ *  Internal variables  *
+ ************************/
+
+static u32 num_pending; // Number of sectors in the queue
+static u32 pending_sector[T2FS_QUEUE_SIZE]; // Sorted disk sector numbers
+static u16 pending_slot[T2FS_QUEUE_SIZE]; // Slot in pending_data of each
+static byte_t pending_data[T2FS_QUEUE_SIZE][SECTOR_SIZE];
+
+static u32 num_extents; // Number of extents of sectors to be discarded
+static u32 extent_start[T2FS_DISCARD_SIZE]; // Sorted, not touching each other
+static u32 extent_count[T2FS_DISCARD_SIZE];
+
+static byte_t *staging; // Aligned buffer where the runs are assembled
+
+
+/************************
+ *  Internal functions  *
+ ************************/
+
+/*-----------------------------------------------------------------------------
+Funct:  Find the position in the queue where the given sector is or would be.
+Input:  sector -> The disk sector
+Return: The index of the first pending sector not less than the given one.
+-----------------------------------------------------------------------------*/
+static u32 lower_bound(u32 sector)
+{
+    u32 low = 0, high = num_pending;
+    while(low < high)
+    {
+        u32 mid = low + (high - low)/2;
+        if(pending_sector[mid] < sector)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Remove the extent at the given position of the discard list.
+-----------------------------------------------------------------------------*/
+static void remove_extent(u32 i)
+{
+    num_extents--;
+    memmove(&extent_start[i], &extent_start[i+1],
+            (num_extents - i) * sizeof(extent_start[0]));
+    memmove(&extent_count[i], &extent_count[i+1],
+            (num_extents - i) * sizeof(extent_count[0]));
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Discard the extents of at least T2FS_DISCARD_MIN sectors, trimmed to
+            DISK_ALIGN boundaries (the host's page size, usually), so the
+            host doesn't need to zero partial pages. Smaller extents are kept,
+            as they may grow, unless 'all' is set.
+Input:  all -> If the smaller extents should be dropped as well
+-----------------------------------------------------------------------------*/
+static void issue_discards(bool all)
+{
+    const u32 align = DISK_ALIGN / SECTOR_SIZE;
+    for(u32 i=0; i<num_extents; )
+    {
+        u32 first = (extent_start[i] + align - 1) / align * align;
+        u32 last = (extent_start[i] + extent_count[i]) / align * align;
+        if(first < last && last - first >= T2FS_DISCARD_MIN)
+            discard_sectors(first, last - first); // Just a hint: errors ignored
+        else if(!all)
+        {
+            i++;
+            continue;
+        }
+        remove_extent(i);
+    }
+}
+
+
+/************************
+ *  External functions  *
+ ************************/
+
+/*-----------------------------------------------------------------------------
+Funct:  Queue consecutive sector writes, replacing pending writes to the same
+            sectors. The data is copied.
+        If there isn't enough room in the queue, it's flushed first. Writes
+            larger than the whole queue go straight to disk.
+Input:  sector -> First disk sector (absolute, not relative to the partition)
+        count  -> Number of sectors
+        data   -> Where the data is (count * SECTOR_SIZE bytes)
+Return: On success, 0 is returned. Otherwise, a negative value is returned.
+-----------------------------------------------------------------------------*/
+int t2fs_queue_write(u32 sector, u32 count, byte_t *data)
+{
+    t2fs_cache_lock();
+    // Count the sectors not in the queue yet
+    u32 i = lower_bound(sector), new_sectors = count;
+    for(u32 j = i; j < num_pending && pending_sector[j] < sector + count; j++)
+        new_sectors--;
+
+    if(new_sectors > T2FS_QUEUE_SIZE - num_pending)
+    {
+        int res = t2fs_queue_flush();
+        if(res == 0 && count > T2FS_QUEUE_SIZE) // Doesn't fit at all
+            res = write_sectors(sector, count, data) != 0 ? -1 : 0;
+        if(res != 0 || count > T2FS_QUEUE_SIZE)
+        {
+            t2fs_cache_unlock();
+            return res;
+        }
+        i = 0;
+    }
+
+    for(u32 k=0; k<count; k++, data += SECTOR_SIZE)
+    {
+        // Entries are sorted, so the next one is at i or later
+        while(i < num_pending && pending_sector[i] < sector + k)
+            i++;
+        if(i == num_pending || pending_sector[i] != sector + k)
+        {
+            // Insert a new entry at i. The slots in use are 0..num_pending-1
+            memmove(&pending_sector[i+1], &pending_sector[i],
+                    (num_pending - i) * sizeof(pending_sector[0]));
+            memmove(&pending_slot[i+1], &pending_slot[i],
+                    (num_pending - i) * sizeof(pending_slot[0]));
+            pending_sector[i] = sector + k;
+            pending_slot[i] = num_pending++;
+        }
+        memcpy(pending_data[pending_slot[i]], data, SECTOR_SIZE);
+    }
+    t2fs_cache_unlock();
+    return 0;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Copy the pending writes of consecutive sectors over data read from
+            the disk, so it's up to date.
+Input:  sector -> First disk sector (absolute, not relative to the partition)
+        count  -> Number of sectors
+        data   -> The data read (count * SECTOR_SIZE bytes)
+Return: The number of sectors that were pending (and copied).
+-----------------------------------------------------------------------------*/
+u32 t2fs_queue_overlay(u32 sector, u32 count, byte_t *data)
+{
+    t2fs_cache_lock();
+    u32 i = lower_bound(sector), copied = 0;
+    for(; i < num_pending && pending_sector[i] < sector + count; i++, copied++)
+    {
+        memcpy(data + (pending_sector[i] - sector) * SECTOR_SIZE,
+               pending_data[pending_slot[i]], SECTOR_SIZE);
+    }
+    t2fs_cache_unlock();
+    return copied;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Read consecutive sectors, seeing the pending writes. If all of them
+            are pending, the disk isn't read.
+Input:  sector -> First disk sector (absolute, not relative to the partition)
+        count  -> Number of sectors
+        data   -> Where to store the data read (count * SECTOR_SIZE bytes)
+Return: On success, 0 is returned. Otherwise, a negative value is returned.
+-----------------------------------------------------------------------------*/
+int t2fs_queue_read(u32 sector, u32 count, byte_t *data)
+{
+    t2fs_cache_lock();
+    int res = 0;
+    u32 i = lower_bound(sector);
+    if(i + count <= num_pending && pending_sector[i] == sector
+       && pending_sector[i + count - 1] == sector + count - 1)
+        t2fs_queue_overlay(sector, count, data); // All pending
+    else if(read_sectors(sector, count, data) != 0)
+        res = -1;
+    else
+        t2fs_queue_overlay(sector, count, data);
+    t2fs_cache_unlock();
+    return res;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Drop the pending writes of consecutive sectors, which are about to be
+            written with newer data without the queue.
+Input:  sector -> First disk sector (absolute, not relative to the partition)
+        count  -> Number of sectors
+-----------------------------------------------------------------------------*/
+void t2fs_queue_cancel(u32 sector, u32 count)
+{
+    t2fs_cache_lock();
+    u32 i = lower_bound(sector);
+    while(i < num_pending && pending_sector[i] < sector + count)
+    {
+        // The slots in use must stay 0..num_pending-1: the last one moves
+        u16 last = num_pending - 1;
+        if(pending_slot[i] != last)
+        {
+            u32 j = 0;
+            while(pending_slot[j] != last)
+                j++;
+            memcpy(pending_data[pending_slot[i]], pending_data[last],
+                   SECTOR_SIZE);
+            pending_slot[j] = pending_slot[i];
+        }
+        memmove(&pending_sector[i], &pending_sector[i+1],
+                (num_pending - i - 1) * sizeof(pending_sector[0]));
+        memmove(&pending_slot[i], &pending_slot[i+1],
+                (num_pending - i - 1) * sizeof(pending_slot[0]));
+        num_pending--;
+    }
+    t2fs_cache_unlock();
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Mark consecutive sectors as unused, to be discarded by the next
+            t2fs_queue_flush, unless they're used again before that (see
+            t2fs_queue_reuse).
+Input:  sector -> First disk sector (absolute, not relative to the partition)
+        count  -> Number of sectors
+-----------------------------------------------------------------------------*/
+void t2fs_queue_discard(u32 sector, u32 count)
+{
+    t2fs_cache_lock();
+    // First extent that ends at or after 'sector' (may be merged with it)
+    u32 i = 0;
+    while(i < num_extents && extent_start[i] + extent_count[i] < sector)
+        i++;
+
+    u32 start = sector, end = sector + count;
+    while(i < num_extents && extent_start[i] <= end) // Merge with touching
+    {
+        start = MIN(start, extent_start[i]);
+        end = MAX(end, extent_start[i] + extent_count[i]);
+        remove_extent(i);
+    }
+
+    if(num_extents == T2FS_DISCARD_SIZE) // Full: make room
+    {
+        issue_discards(false);
+        if(num_extents == T2FS_DISCARD_SIZE)
+            issue_discards(true);
+        i = 0;
+        while(i < num_extents && extent_start[i] < start)
+            i++;
+    }
+
+    memmove(&extent_start[i+1], &extent_start[i],
+            (num_extents - i) * sizeof(extent_start[0]));
+    memmove(&extent_count[i+1], &extent_count[i],
+            (num_extents - i) * sizeof(extent_count[0]));
+    extent_start[i] = start;
+    extent_count[i] = end - start;
+    num_extents++;
+    t2fs_cache_unlock();
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Mark consecutive sectors as used again, so they aren't discarded.
+Input:  sector -> First disk sector (absolute, not relative to the partition)
+        count  -> Number of sectors
+-----------------------------------------------------------------------------*/
+void t2fs_queue_reuse(u32 sector, u32 count)
+{
+    t2fs_cache_lock();
+    u32 end = sector + count;
+    for(u32 i=0; i<num_extents && extent_start[i] < end; )
+    {
+        u32 ext_end = extent_start[i] + extent_count[i];
+        if(ext_end <= sector) // Before the reused sectors
+        {
+            i++;
+            continue;
+        }
+        if(extent_start[i] < sector && ext_end > end) // Split in two
+        {
+            extent_count[i] = sector - extent_start[i];
+            if(num_extents < T2FS_DISCARD_SIZE) // Room for the 2nd half
+            {
+                memmove(&extent_start[i+2], &extent_start[i+1],
+                        (num_extents - i - 1) * sizeof(extent_start[0]));
+                memmove(&extent_count[i+2], &extent_count[i+1],
+                        (num_extents - i - 1) * sizeof(extent_count[0]));
+                extent_start[i+1] = end;
+                extent_count[i+1] = ext_end - end;
+                num_extents++;
+            }
+            break;
+        }
+        if(extent_start[i] < sector) // Keep the head
+        {
+            extent_count[i] = sector - extent_start[i];
+            i++;
+        }
+        else if(ext_end > end) // Keep the tail
+        {
+            extent_start[i] = end;
+            extent_count[i] = ext_end - end;
+            i++;
+        }
+        else // All of it is reused
+            remove_extent(i);
+    }
+    t2fs_cache_unlock();
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Forget all sectors marked to be discarded, without discarding them.
+        Needed when the layout of the partition changes (formatting).
+-----------------------------------------------------------------------------*/
+void t2fs_queue_forget(void)
+{
+    t2fs_cache_lock();
+    num_extents = 0;
+    t2fs_cache_unlock();
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Write all pending sectors to disk, in ascending order, merging the
+            adjacent ones into single requests, all submitted at once. Then,
+            discard the large enough extents of unused sectors.
+        The sectors of the requests that fail stay in the queue, so they're
+            written by the next flush (the cache entries they came from are
+            clean already).
+Return: On success, 0 is returned. Otherwise, a negative value is returned.
+-----------------------------------------------------------------------------*/
+int t2fs_queue_flush(void)
+{
+    t2fs_cache_lock();
+    if(num_pending == 0)
+    {
+        issue_discards(false);
+        t2fs_cache_unlock();
+        return 0;
+    }
+    if(!staging)
+        staging = t2fs_alloc_buffer(T2FS_QUEUE_SIZE * SECTOR_SIZE);
+    if(!staging)
+    {
+        t2fs_cache_unlock();
+        return -1;
+    }
+
+    // Lay the sectors out in order, so each run is contiguous in memory
+    struct disk_request reqs[T2FS_QUEUE_SIZE];
+    int nreqs = 0;
+    for(u32 i=0; i<num_pending; i++)
+    {
+        byte_t *dst = staging + i * SECTOR_SIZE;
+        memcpy(dst, pending_data[pending_slot[i]], SECTOR_SIZE);
+        if(nreqs > 0 && pending_sector[i] == pending_sector[i-1] + 1)
+        {
+            reqs[nreqs-1].count++; // Merge with the previous run
+            continue;
+        }
+        reqs[nreqs].sector = pending_sector[i];
+        reqs[nreqs].count = 1;
+        reqs[nreqs].buffer = dst;
+        reqs[nreqs].write = 1;
+        reqs[nreqs].result = -1; // If not even submitted
+        nreqs++;
+    }
+
+    int res = submit_sectors(reqs, nreqs) != 0 ? -1 : 0;
+
+    // Keep the runs that failed, still sorted, in slots 0..num_pending-1
+    num_pending = 0;
+    for(int r=0; r<nreqs; r++)
+    {
+        if(reqs[r].result == 0)
+            continue;
+        for(u32 k=0; k<reqs[r].count; k++, num_pending++)
+        {
+            pending_sector[num_pending] = reqs[r].sector + k;
+            pending_slot[num_pending] = num_pending;
+            memcpy(pending_data[num_pending],
+                   reqs[r].buffer + k * SECTOR_SIZE, SECTOR_SIZE);
+        }
+    }
+    issue_discards(false);
+    t2fs_cache_unlock();
+    return res;
+}
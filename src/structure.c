@@ -60,10 +60,11 @@ static int block_insert_entry(u32 block, va_list args)
     char *name = va_arg(args, char*);
     u32 inode = va_arg(args, u32);
 
-    int res = t2fs_read_block(block_buffer, block);
+    struct block_handle h;
+    int res = t2fs_get_block(&h, block, CACHE_KIND_DIRECTORY, false);
     if(res != 0)
         return res;
-    struct t2fs_record *dir = (struct t2fs_record*)block_buffer;
+    struct t2fs_record *dir = (struct t2fs_record*)h.data;
     int num_entries = superblock.block_size / sizeof(struct t2fs_record);
     for(int i=0; i<num_entries; i++)
     {
@@ -71,9 +72,10 @@ static int block_insert_entry(u32 block, va_list args)
         {
             dir[i].inode = inode;
             strcpy(dir[i].name, name);
-            return t2fs_write_block(block_buffer, block);
+            return t2fs_put_block(&h, true);
         }
     }
+    t2fs_put_block(&h, false);
     return 1; // Iterate further
 }
 
@@ -96,10 +98,11 @@ static int block_search_by_name(u32 block, va_list args)
     bool del = va_arg(args, int); // Should be int instead of bool
                             // because arguments smaller than int get promoted
 
-    int res = t2fs_read_block(block_buffer, block);
+    struct block_handle h;
+    int res = t2fs_get_block(&h, block, CACHE_KIND_DIRECTORY, false);
     if(res != 0)
         return res;
-    struct t2fs_record *dir = (struct t2fs_record*)block_buffer;
+    struct t2fs_record *dir = (struct t2fs_record*)h.data;
     int num_entries = superblock.block_size / sizeof(struct t2fs_record);
     *inode = 0;
     for(int i=0; i<num_entries; i++)
@@ -107,16 +110,15 @@ static int block_search_by_name(u32 block, va_list args)
         if(dir[i].inode != 0 && strcmp(dir[i].name, name) == 0) // Found entry
         {
             *inode = dir[i].inode;
-            res = 0;
             if(del)
             {
                 struct t2fs_record aux = {};
                 dir[i] = aux;
-                res = t2fs_write_block(block_buffer, block);
             }
-            return res;
+            return t2fs_put_block(&h, del);
         }
     }
+    t2fs_put_block(&h, false);
     return 1; // Iterate further
 }
 
@@ -135,19 +137,21 @@ static int block_search_by_inode(u32 block, va_list args)
     char *name = va_arg(args, char*);
     u32 inode = va_arg(args, u32);
 
-    int res = t2fs_read_block(block_buffer, block);
+    struct block_handle h;
+    int res = t2fs_get_block(&h, block, CACHE_KIND_DIRECTORY, false);
     if(res != 0)
         return res;
-    struct t2fs_record *dir = (struct t2fs_record*)block_buffer;
+    struct t2fs_record *dir = (struct t2fs_record*)h.data;
     int num_entries = superblock.block_size / sizeof(struct t2fs_record);
     for(int i=0; i<num_entries; i++)
     {
         if(dir[i].inode == inode) // Found entry
         {
             strcpy(name, dir[i].name);
-            return 0;
+            return t2fs_put_block(&h, false);
         }
     }
+    t2fs_put_block(&h, false);
     return 1; // Iterate further
 }
 
@@ -162,19 +166,24 @@ Return: On failure, 0 is returned. On error, a negative value is returned.
 static int block_dir_deletable(u32 block, va_list args)
 {
     (void)args; // Unused parameter
-    int res = t2fs_read_block(block_buffer, block);
+    struct block_handle h;
+    int res = t2fs_get_block(&h, block, CACHE_KIND_DIRECTORY, false);
     if(res != 0)
         return res;
-    struct t2fs_record *dir = (struct t2fs_record*)block_buffer;
+    struct t2fs_record *dir = (struct t2fs_record*)h.data;
     int num_entries = superblock.block_size / sizeof(struct t2fs_record);
     for(int i=0; i<num_entries; i++)
     {
         if(dir[i].inode != 0) // Valid entry, must be equal to "." or ".." only
         {
             if(strcmp(dir[i].name, ".") != 0 && strcmp(dir[i].name, "..") != 0)
+            {
+                t2fs_put_block(&h, false);
                 return 0; // Valid non-trivial entry, dir can't be deleted
+            }
         }
     }
+    t2fs_put_block(&h, false);
     return 1; // Iterate further. Or, if at the last block, dir is deletable
 }
 
@@ -238,8 +247,11 @@ int insert_entry(u32 dir_inode, char *name, u32 inode)
         if(block == 0)
             return -1;
 
-        memset(block_buffer, 0, superblock.block_size);
-        res = t2fs_write_block(block_buffer, block);
+        struct block_handle h; // Empty, all entries unused
+        res = t2fs_get_block(&h, block, CACHE_KIND_DIRECTORY, true);
+        if(res != 0)
+            return res;
+        res = t2fs_put_block(&h, true);
         if(res != 0)
             return res;
         // Insert specifically in this block, since previous ones are full
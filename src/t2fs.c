@@ -14,6 +14,7 @@
  *   T2FS API functions
  */
 
+#include "apidisk_ext.h"
 #include "libt2fs.h"
 #include "t2fs.h"
 #include <stdio.h>
@@ -57,6 +58,12 @@ void print_superblock(struct t2fs_superblock *sblock)
     printf("    ib_offset         : %u\n", sblock->ib_offset);
     printf("    bb_offset         : %u\n", sblock->bb_offset);
     printf("    blocks_offset     : %u\n", sblock->blocks_offset);
+    printf("    wl_offset         : %u\n", sblock->wl_offset);
+    printf("    wl_sectors        : %u\n", sblock->wl_sectors);
+    printf("    inode_rotor       : %u\n", sblock->inode_rotor);
+    printf("    block_rotor       : %u\n", sblock->block_rotor);
+    printf("    free_inodes       : %u\n", sblock->free_inodes);
+    printf("    free_blocks       : %u\n", sblock->free_blocks);
 }
 
 void print_inode(u32 number, struct t2fs_inode *inode)
@@ -98,8 +105,6 @@ void print_path(struct t2fs_path *path_info)
 
 // All are initialized in init_t2fs
 struct t2fs_superblock superblock;
-byte_t *block_buffer;
-u32 *idx_block_buffer[NUM_INDIRECT_LVL];
 u32 cwd_inode;
 
 
@@ -111,6 +116,47 @@ static struct t2fs_path info; // To get path information
 static struct t2fs_descriptor *fd; // To get descriptors for files
 
 
+/************************
+ *  Internal functions  *
+ ************************/
+
+/*-----------------------------------------------------------------------------
+Funct:  Format the partition and create the root directory (see format2).
+Input:  sectors_per_block -> Size of data block, in disk sectors
+        sparse            -> If the partition should be discarded first
+Return: On success, 0 is returned. Otherwise, a non-zero value is returned.
+-----------------------------------------------------------------------------*/
+static int format_partition(int sectors_per_block, bool sparse)
+{
+    // We shouldn't call t2fs_init() in the beginning of this function, since
+    //   this function doesn't expect the partition to already be formatted
+
+    if(sectors_per_block < 1 || sectors_per_block > 128) // Max allowed is 128
+        return -1;
+
+    // Format partition
+    int res = init_format(sectors_per_block, partition, sparse);
+    if(res != 0)
+        return res;
+
+    res = init_t2fs(partition); // Initialize before calling functions
+    if(res != 0)
+        return res;
+
+    if(use_new_inode(FILETYPE_DIRECTORY) != ROOT_INODE) // Should be 1
+        return -1;
+
+    res = insert_entry(ROOT_INODE, ".", ROOT_INODE);
+    if(res != 0)
+        return res;
+    res = insert_entry(ROOT_INODE, "..", ROOT_INODE);
+    if(res != 0)
+        return res;
+
+    return 0;
+}
+
+
 /************************
  *  API open functions  *
  ************************/
@@ -141,31 +187,13 @@ int identify2 (char *name, int size)
 
 int format2 (int sectors_per_block)
 {
-    // We shouldn't call t2fs_init() in the beginning of this function, since
-    //   this function doesn't expect the partition to already be formatted
-
-    if(sectors_per_block < 1 || sectors_per_block > 128) // Max allowed is 128
-        return -1;
-
-    int res = init_format(sectors_per_block, partition); // Format partition
-    if(res != 0)
-        return res;
-
-    res = init_t2fs(partition); // Initialize before calling functions
-    if(res != 0)
-        return res;
-
-    if(use_new_inode(FILETYPE_DIRECTORY) != ROOT_INODE) // Should be 1
-        return -1;
+    return format_partition(sectors_per_block, false);
+}
 
-    res = insert_entry(ROOT_INODE, ".", ROOT_INODE);
-    if(res != 0)
-        return res;
-    res = insert_entry(ROOT_INODE, "..", ROOT_INODE);
-    if(res != 0)
-        return res;
 
-    return 0;
+int format2_sparse (int sectors_per_block)
+{
+    return format_partition(sectors_per_block, true);
 }
 
 
@@ -249,6 +277,7 @@ int read2 (FILE2 handle, char *buffer, int size)
     if(size == 0)
         return 0; // 0 bytes read
 
+    t2fs_readahead(fd, size);
     int ans = t2fs_rw_data((byte_t*)buffer, fd->inode,
                            fd->curr_pos, size, false);
     if(ans >= 0)
@@ -506,9 +535,11 @@ int ln2 (char *linkpath, char *pointpath)
     if(read_inode(inode, &inode_s) != 0)
         return -1;
 
-    memset(block_buffer, 0, superblock.block_size);
-    strncpy((char*)block_buffer, pointpath, superblock.block_size);
-    return t2fs_write_block(block_buffer, inode_s.pointers[0]);
+    struct block_handle h; // Zeroed, not read
+    if(t2fs_get_block(&h, inode_s.pointers[0], CACHE_KIND_DATA, true) != 0)
+        return -1;
+    strncpy((char*)h.data, pointpath, superblock.block_size);
+    return t2fs_put_block(&h, true);
 }
 
 
@@ -526,3 +557,47 @@ int hardln2(char *linkpath, char *pointpath)
 
     return insert_entry(info.par_inode, info.name, inode);
 }
+
+
+int sync2 (void)
+{
+    if(init_t2fs(partition) != 0) return -1;
+
+    if(t2fs_bitmap_flush() != 0 || t2fs_cache_flush() != 0)
+        return -1;
+    return flush_disk() != 0 ? -1 : 0; // Durable on the host as well
+}
+
+
+int umount2 (void)
+{
+    if(init_t2fs(partition) != 0) return -1;
+
+    int res = sync2();
+    if(res != 0)
+        return res;
+    close_all_desc();
+    t2fs_warmup_save(); // Just a hint for the next mount: errors ignored
+    res = init_write_superblock(); // With the rotors and free counts
+    if(res == 0)
+        res = flush_disk(); // The warm list and the superblock, durable too
+    if(res != 0)
+        return res;
+    return init_unmount();
+}
+
+
+int statfs2 (STATFS2 *stats)
+{
+    if(init_t2fs(partition) != 0) return -1;
+    if(!stats) return -1;
+
+    t2fs_cache_lock(); // The counts change with the bitmaps (see bitmap.c)
+    stats->block_size = superblock.block_size;
+    stats->total_blocks = superblock.num_blocks;
+    stats->free_blocks = superblock.free_blocks;
+    stats->total_inodes = superblock.num_inodes;
+    stats->free_inodes = superblock.free_inodes;
+    t2fs_cache_unlock();
+    return 0;
+}
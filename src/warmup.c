@@ -0,0 +1,215 @@
+/*****************************************************************************
+ *  Instituto de Informatica - Universidade Federal do Rio Grande do Sul     *
+ *  INF01142 - Sistemas Operacionais I N                                     *
+ *  Task 2 File System (T2FS) 2019/1                                         *
+ *                                                                           *
+ *  Authors: Yuri Jaschek                                                    *
+ *           Giovane Fonseca                                                 *
+ *           Humberto Lentz                                                  *
+ *           Matheus F. Kovaleski                                            *
+ *                                                                           *
+ *****************************************************************************/
+
+/*
+ *   Cache warm-up functions
+ *
+ *   On a clean unmount, what is in the cache is recorded in the warm list, a
+ *       reserved area of the partition (see the superblock): the metadata
+ *       first, and then the file data most used.
+ *   When the partition is initialized again, a thread reads the list back
+ *       into the cache, in ascending sector order, so the first operations
+ *       don't have to wait for the disk. Being just a hint, errors are
+ *       ignored, and the list is checked before being used.
+ *   While a device is simulated (see disk_sim_start), the list is read before
+ *       init_t2fs returns instead, so the simulated times don't depend on how
+ *       the thread and the program's requests interleave.
+ */
+
+#include "apidisk.h"
+#include "apidisk_ext.h"
+#include "libt2fs.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/************************
+ *  Internal variables  *
+ ************************/
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t thread;
+static bool running; // If the thread has been started (and not stopped)
+
+
+/************************
+ *  Internal functions  *
+ ************************/
+
+static int compare_sector(const void *a, const void *b)
+{
+    u32 x = ((struct t2fs_warm_entry*)a)->sector;
+    u32 y = ((struct t2fs_warm_entry*)b)->sector;
+    return x < y ? -1 : x > y;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Check if an entry of the warm list is something that can be cached:
+            a sector of the inodes table, or a data block (the bitmaps are
+            always in memory, see bitmap.c).
+Return: If the entry is valid.
+-----------------------------------------------------------------------------*/
+static bool valid_entry(struct t2fs_warm_entry *entry)
+{
+    u32 s = entry->sector;
+    if(entry->kind >= CACHE_NUM_KINDS)
+        return false;
+    if(s >= superblock.it_offset && s < superblock.ib_offset)
+        return true;
+    s -= superblock.blocks_offset;
+    return entry->sector >= superblock.blocks_offset
+           && s % superblock.sectors_per_block == 0
+           && s / superblock.sectors_per_block < superblock.num_blocks;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Main function of the warm-up thread. Read the warm list, keep the
+            hottest entries that fit in half of the cache (file data in half
+            of the part of it not reserved for metadata), and read them into
+            it in batches, in ascending sector order, until stopped.
+-----------------------------------------------------------------------------*/
+static void *warmup_main(void *arg)
+{
+    (void)arg;
+    u32 size = superblock.wl_sectors * SECTOR_SIZE;
+    struct t2fs_warm_entry *list = (struct t2fs_warm_entry*)
+                                   t2fs_alloc_buffer(size);
+    if(!list)
+        return 0; // NULL
+    if(t2fs_queue_read(superblock.first_sector + superblock.wl_offset,
+                       superblock.wl_sectors, (byte_t*)list) != 0)
+    {
+        t2fs_free_buffer((byte_t*)list, size);
+        return 0; // NULL
+    }
+
+    // The list is in hotness order: the coldest are left out
+    u32 n = 0, max = size / sizeof(*list), bytes = 0, data_bytes = 0;
+    u32 capacity = t2fs_cache_capacity();
+    u32 data_capacity = t2fs_cache_data_capacity();
+    for(; n < max && list[n].sector != 0 && valid_entry(&list[n]); n++)
+    {
+        u32 entry_bytes = list[n].sector < superblock.blocks_offset
+                        ? SECTOR_SIZE : superblock.block_size;
+        bytes += entry_bytes;
+        if(list[n].kind == CACHE_KIND_DATA)
+            data_bytes += entry_bytes;
+        if(bytes > capacity / 2 || data_bytes > data_capacity / 2)
+            break;
+    }
+    qsort(list, n, sizeof(*list), compare_sector);
+
+    for(u32 i=0; i<n; i+=T2FS_MAX_BATCH)
+    {
+        pthread_mutex_lock(&lock);
+        bool stop = !running;
+        pthread_mutex_unlock(&lock);
+        if(stop)
+            break;
+        t2fs_cache_warm(&list[i], MIN(n - i, (u32)T2FS_MAX_BATCH));
+    }
+    t2fs_free_buffer((byte_t*)list, size);
+    return 0; // NULL
+}
+
+
+/************************
+ *  External functions  *
+ ************************/
+
+/*-----------------------------------------------------------------------------
+Funct:  Record the warm list of what is in the cache now, if the partition
+            has room for it. To be called on a clean unmount, with everything
+            else already written.
+Return: On success, 0 is returned. Otherwise, a negative value is returned.
+-----------------------------------------------------------------------------*/
+int t2fs_warmup_save(void)
+{
+    if(superblock.wl_sectors == 0) // Formatted without the warm list
+        return 0;
+
+    u32 size = superblock.wl_sectors * SECTOR_SIZE;
+    byte_t *list = t2fs_alloc_buffer(size);
+    if(!list)
+        return -1;
+    memset(list, 0, size); // The rest ends the list
+    t2fs_cache_hot((struct t2fs_warm_entry*)list,
+                   size / sizeof(struct t2fs_warm_entry));
+
+    int res = t2fs_queue_write(superblock.first_sector + superblock.wl_offset,
+                               superblock.wl_sectors, list);
+    if(res == 0)
+        res = t2fs_queue_flush();
+    t2fs_free_buffer(list, size);
+    return res;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Start the warm-up thread, which reads the warm list of the partition
+            into the cache. Nothing is done if already started, or if the
+            partition has no warm list.
+        While a device is simulated, the list is read right here instead.
+Return: On success, 0 is returned. Otherwise, a negative value is returned.
+-----------------------------------------------------------------------------*/
+int t2fs_warmup_start(void)
+{
+    if(superblock.wl_sectors == 0)
+        return 0;
+
+    pthread_mutex_lock(&lock);
+    if(running)
+    {
+        pthread_mutex_unlock(&lock);
+        return 0;
+    }
+    running = true;
+    if(disk_sim_active())
+    {
+        pthread_mutex_unlock(&lock);
+        warmup_main(0);
+        pthread_mutex_lock(&lock);
+        running = false;
+        pthread_mutex_unlock(&lock);
+        return 0;
+    }
+    if(pthread_create(&thread, 0, warmup_main, 0) != 0)
+    {
+        running = false;
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+
+/*-----------------------------------------------------------------------------
+Funct:  Stop the warm-up thread, if started, waiting for it to finish. It
+            stops after the batch being read, if not done yet.
+-----------------------------------------------------------------------------*/
+void t2fs_warmup_stop(void)
+{
+    pthread_mutex_lock(&lock);
+    if(!running)
+    {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    running = false;
+    pthread_mutex_unlock(&lock);
+
+    pthread_join(thread, 0);
+}
@@ -0,0 +1,41 @@
+/*****************************************************************************
+ *  Instituto de Informatica - Universidade Federal do Rio Grande do Sul     *
+ *  INF01142 - Sistemas Operacionais I N                                     *
+ *  Task 2 File System (T2FS) 2019/1                                         *
+ *                                                                           *
+ *  Authors: Yuri Jaschek                                                    *
+ *           Giovane Fonseca                                                 *
+ *           Humberto Lentz                                                  *
+ *           Matheus F. Kovaleski                                            *
+ *                                                                           *
+ *****************************************************************************/
+
+/*
+ *   Checks of the library, each program on a RAM disk of its own (see
+ *       ramdisk_create), run by "make check"
+ */
+
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdio.h>
+
+static int failures; // Number of checks that failed
+
+// Report the condition if it's false, going on with the program
+#define CHECK(cond) \
+    do { \
+        if(!(cond)) \
+        { \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", \
+                    __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while(0)
+
+// Report the result: to be returned by main (0 if every check passed)
+#define CHECK_DONE() \
+    (printf("%-16s %s\n", __FILE__, failures ? "FAILED" : "ok"), \
+     failures != 0)
+
+#endif // CHECK_H
@@ -0,0 +1,174 @@
+/*****************************************************************************
+ *  Instituto de Informatica - Universidade Federal do Rio Grande do Sul     *
+ *  INF01142 - Sistemas Operacionais I N                                     *
+ *  Task 2 File System (T2FS) 2019/1                                         *
+ *                                                                           *
+ *  Authors: Yuri Jaschek                                                    *
+ *           Giovane Fonseca                                                 *
+ *           Humberto Lentz                                                  *
+ *           Matheus F. Kovaleski                                            *
+ *                                                                           *
+ *****************************************************************************/
+
+/*
+ *   Allocation: the bitmaps, their next-fit rotors and the free counts
+ *       reported by statfs2, across remounts and from the old bitmap layout
+ */
+
+#include "apidisk.h"
+#include "apidisk_ext.h"
+#include "libt2fs.h"
+#include "t2fs.h"
+#include "check.h"
+#include <string.h>
+
+#define DISK_SECTORS 8192
+#define NUM_FILES    10
+
+
+static STATFS2 usage(void)
+{
+    STATFS2 st;
+    memset(&st, 0, sizeof(st));
+    CHECK(statfs2(&st) == 0);
+    return st;
+}
+
+
+static bool same_usage(STATFS2 a, STATFS2 b)
+{
+    return a.free_blocks == b.free_blocks && a.free_inodes == b.free_inodes
+        && a.total_blocks == b.total_blocks
+        && a.total_inodes == b.total_inodes;
+}
+
+
+// Create a file of the given number of blocks, filled with c
+static void make_file(char *path, u32 blocks, char c)
+{
+    char buffer[blocks * superblock.block_size];
+    memset(buffer, c, sizeof(buffer));
+    FILE2 f = create2(path);
+    CHECK(f >= 0);
+    CHECK(write2(f, buffer, sizeof(buffer)) == (int)sizeof(buffer));
+    CHECK(close2(f) == 0);
+}
+
+
+// Check the root directory has /f0.../fN, with their contents
+static void check_files(void)
+{
+    int found = 0;
+    DIR2 d = opendir2("/");
+    CHECK(d >= 0);
+    DIRENT2 entry;
+    while(readdir2(d, &entry) == 0)
+        found += entry.name[0] == 'f';
+    CHECK(closedir2(d) == 0);
+    CHECK(found == NUM_FILES);
+
+    char path[16], buffer[2 * 1024], expected[sizeof(buffer)];
+    for(int i=0; i<NUM_FILES; i++)
+    {
+        sprintf(path, "/f%d", i);
+        memset(expected, 'a' + i, sizeof(expected));
+        FILE2 f = open2(path);
+        CHECK(f >= 0);
+        CHECK(read2(f, buffer, sizeof(buffer)) == (int)sizeof(buffer));
+        CHECK(memcmp(buffer, expected, sizeof(buffer)) == 0);
+        CHECK(close2(f) == 0);
+    }
+}
+
+
+// Rewrite the unmounted partition as the first versions of T2FS did: bit
+//   n%8 of byte n%2048 of the sector, and the old signature and superblock
+static void make_old_layout(void)
+{
+    byte_t sector[SECTOR_SIZE], old[SECTOR_SIZE];
+    CHECK(read_sectors(0, 1, sector) == 0);
+    u32 first = ((struct t2fs_mbr*)sector)->ptable[0].first_sector;
+    CHECK(read_sectors(first, 1, sector) == 0);
+    struct t2fs_superblock sblock = *(struct t2fs_superblock*)sector;
+
+    for(u32 s = sblock.ib_offset; s < sblock.blocks_offset; s++)
+    {
+        CHECK(read_sectors(first + s, 1, sector) == 0);
+        memset(old, 0, sizeof(old));
+        for(int k=0; k<8*SECTOR_SIZE; k++)
+        {
+            if(!CHK_BIT(sector[k / 8], k % 8))
+                continue;
+            CHECK(k < SECTOR_SIZE); // Couldn't be used by the old code
+            SET_BIT(old[k % SECTOR_SIZE], k % 8);
+        }
+        CHECK(write_sectors(first + s, 1, old) == 0);
+    }
+
+    // The fields after blocks_offset didn't exist
+    sblock.wl_offset = sblock.wl_sectors = 0;
+    sblock.inode_rotor = sblock.block_rotor = 0;
+    sblock.free_inodes = sblock.free_blocks = 0;
+    strcpy(sblock.signature, T2FS_SIGNATURE_V1);
+    memset(sector, 0, sizeof(sector));
+    memcpy(sector, &sblock, sizeof(sblock));
+    CHECK(write_sectors(first, 1, sector) == 0);
+}
+
+
+int main(void)
+{
+    CHECK(ramdisk_create(DISK_SECTORS, 0) == 0);
+    CHECK(format2(4) == 0);
+
+    // Inode 0 and block 0 are invalid; the root has inode 1 and a block
+    STATFS2 st = usage();
+    CHECK(st.free_inodes == st.total_inodes - 2);
+    CHECK(st.free_blocks == st.total_blocks - 2);
+
+    // Next-fit: the inode allocated is the one found, and the search
+    //   continues after it, even once it's free again
+    u32 next = t2fs_bitmap_find(true);
+    make_file("/a", 3, 'z');
+    struct t2fs_path a = get_path_info("/a", false);
+    CHECK(a.exists && a.inode == next);
+    CHECK(t2fs_bitmap_find(true) == next + 1);
+    STATFS2 before = st;
+    st = usage();
+    CHECK(st.free_inodes == before.free_inodes - 1);
+    CHECK(st.free_blocks == before.free_blocks - 3);
+
+    for(int i=0; i<NUM_FILES; i++)
+    {
+        char path[16];
+        sprintf(path, "/f%d", i);
+        make_file(path, 2, 'a' + i);
+    }
+    before = usage();
+    CHECK(delete2("/a") == 0);
+    st = usage();
+    CHECK(st.free_inodes == before.free_inodes + 1);
+    CHECK(st.free_blocks == before.free_blocks + 3);
+    CHECK(t2fs_bitmap_find(true) > a.inode);
+
+    // The counts kept along match the bitmaps, counted again at mount
+    CHECK(umount2() == 0);
+    CHECK(same_usage(usage(), st));
+    check_files();
+
+    // A partition of the old layout is converted, with the root intact
+    CHECK(umount2() == 0);
+    make_old_layout();
+    CHECK(same_usage(usage(), st));
+    check_files();
+    make_file("/new", 1, 'n');
+    check_files();
+    CHECK(strcmp(superblock.signature, T2FS_SIGNATURE) == 0);
+    CHECK(umount2() == 0);
+    st.free_inodes--;
+    st.free_blocks--;
+    CHECK(same_usage(usage(), st));
+    check_files();
+
+    return CHECK_DONE();
+}
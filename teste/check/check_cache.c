@@ -0,0 +1,132 @@
+/*****************************************************************************
+ *  Instituto de Informatica - Universidade Federal do Rio Grande do Sul     *
+ *  INF01142 - Sistemas Operacionais I N                                     *
+ *  Task 2 File System (T2FS) 2019/1                                         *
+ *                                                                           *
+ *  Authors: Yuri Jaschek                                                    *
+ *           Giovane Fonseca                                                 *
+ *           Humberto Lentz                                                  *
+ *           Matheus F. Kovaleski                                            *
+ *                                                                           *
+ *****************************************************************************/
+
+/*
+ *   Cache: warm-up at mount within the capacity and the metadata reserve set
+ *       by cache2_config, and shrinking it with the data in use
+ */
+
+#include "apidisk.h"
+#include "apidisk_ext.h"
+#include "t2fs.h"
+#include "check.h"
+#include <malloc.h>
+#include <string.h>
+
+#define DISK_SECTORS 16384
+#define NUM_FILES    40
+#define FILE_SIZE    8192
+
+
+static CACHESTAT2 stats(void)
+{
+    CACHESTAT2 st;
+    memset(&st, 0, sizeof(st));
+    CHECK(t2fs_cache_stats(&st) == 0);
+    return st;
+}
+
+
+// Bytes of data in the cache
+static unsigned int cached(void)
+{
+    CACHESTAT2 st = stats();
+    unsigned int bytes = 0;
+    for(int k=0; k<CACHE_NUM_KINDS; k++)
+        bytes += st.kind_bytes[k];
+    return bytes;
+}
+
+
+// Check the data in the cache fits in its capacity and the data share
+static void check_fits(void)
+{
+    CACHESTAT2 st = stats();
+    CHECK(cached() <= st.capacity);
+    CHECK(st.kind_bytes[CACHE_KIND_DATA] <= st.capacity - st.meta_reserve);
+}
+
+
+// Read every file, checking its contents
+static void read_files(void)
+{
+    static char buffer[FILE_SIZE], expected[FILE_SIZE];
+    char path[16];
+    for(int i=0; i<NUM_FILES; i++)
+    {
+        sprintf(path, "/f%d", i);
+        memset(expected, 'a' + i % 26, FILE_SIZE);
+        FILE2 f = open2(path);
+        CHECK(f >= 0);
+        CHECK(read2(f, buffer, FILE_SIZE) == FILE_SIZE);
+        CHECK(memcmp(buffer, expected, FILE_SIZE) == 0);
+        CHECK(close2(f) == 0);
+    }
+}
+
+
+int main(void)
+{
+    CHECK(ramdisk_create(DISK_SECTORS, 0) == 0);
+    // Simulated, the warm-up is done by the mount itself (see warmup.c)
+    CHECK(disk_sim_start(&disk_sim_ssd, DISK_SECTORS) == 0);
+    CHECK(format2(8) == 0);
+
+    static char buffer[FILE_SIZE];
+    char path[16];
+    for(int i=0; i<NUM_FILES; i++)
+    {
+        sprintf(path, "/f%d", i);
+        memset(buffer, 'a' + i % 26, FILE_SIZE);
+        FILE2 f = create2(path);
+        CHECK(f >= 0);
+        CHECK(write2(f, buffer, FILE_SIZE) == FILE_SIZE);
+        CHECK(close2(f) == 0);
+    }
+    for(int r=0; r<3; r++) // So file data is in the warm list too
+        read_files();
+    CHECK(umount2() == 0); // Saves the warm list
+
+    // Most of the cache reserved for metadata: the warm list has more file
+    //   data than the rest takes, and the warm-up must not evict itself
+    CHECK(cache2_config(256*1024, 192*1024) == 0);
+    CACHESTAT2 before = stats();
+    STATFS2 usage;
+    CHECK(statfs2(&usage) == 0); // Mounts, warming the cache
+    CACHESTAT2 after = stats();
+    CHECK(after.evictions == before.evictions);
+    CHECK(after.kind_bytes[CACHE_KIND_DATA] > 0);
+    CHECK(after.kind_bytes[CACHE_KIND_DATA] <= (256 - 192) * 1024 / 2);
+    check_fits();
+
+    // Shrinking evicts what doesn't fit anymore, and the data is intact
+    CHECK(cache2_config(64*1024, 32*1024) == 0);
+    check_fits();
+    read_files();
+    check_fits();
+
+    // The memory of what is evicted is given back, not kept by the cache
+    unsigned int bytes = cached();
+    size_t held = mallinfo2().uordblks;
+    CHECK(cache2_config(16*1024, 16*1024) == 0); // No room for file data
+    CHECK(held - mallinfo2().uordblks >= bytes - cached());
+    read_files();
+    CHECK(stats().kind_bytes[CACHE_KIND_DATA] == 0);
+
+    CHECK(cache2_config(1024, 2048) != 0); // Reserve larger than the cache
+    CHECK(umount2() == 0);
+    CHECK(cache2_config(256*1024, 0) == 0);
+    read_files();
+    check_fits();
+
+    return CHECK_DONE();
+}
@@ -0,0 +1,53 @@
+/*****************************************************************************
+ *  Instituto de Informatica - Universidade Federal do Rio Grande do Sul     *
+ *  INF01142 - Sistemas Operacionais I N                                     *
+ *  Task 2 File System (T2FS) 2019/1                                         *
+ *                                                                           *
+ *  Authors: Yuri Jaschek                                                    *
+ *           Giovane Fonseca                                                 *
+ *           Humberto Lentz                                                  *
+ *           Matheus F. Kovaleski                                            *
+ *                                                                           *
+ *****************************************************************************/
+
+/*
+ *   Flusher: dirty data is written back within the age set, even when it's
+ *       lowered while the thread is running
+ */
+
+#include "apidisk.h"
+#include "apidisk_ext.h"
+#include "libt2fs.h"
+#include "t2fs.h"
+#include "check.h"
+#include <string.h>
+#include <unistd.h>
+
+#define DISK_SECTORS 8192
+
+
+int main(void)
+{
+    CHECK(ramdisk_create(DISK_SECTORS, 0) == 0);
+    CHECK(format2(4) == 0);
+
+    // Woken up every second, for an age of 2 s
+    CHECK(t2fs_flusher_start(2000, 90, 100) == 0);
+    char buffer[4 * 1024];
+    memset(buffer, 'x', sizeof(buffer));
+    FILE2 f = create2("/file");
+    CHECK(f >= 0);
+    CHECK(write2(f, buffer, sizeof(buffer)) == (int)sizeof(buffer));
+    CHECK(close2(f) == 0);
+    CHECK(t2fs_cache_dirty() > 0);
+    usleep(100 * 1000); // The thread is sleeping by now
+
+    // Much less than the second the thread would still sleep for
+    CHECK(t2fs_flusher_start(20, 90, 100) == 0);
+    usleep(300 * 1000);
+    CHECK(t2fs_cache_dirty() == 0);
+
+    t2fs_flusher_stop();
+    CHECK(umount2() == 0);
+    return CHECK_DONE();
+}
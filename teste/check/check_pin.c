@@ -0,0 +1,93 @@
+/*****************************************************************************
+ *  Instituto de Informatica - Universidade Federal do Rio Grande do Sul     *
+ *  INF01142 - Sistemas Operacionais I N                                     *
+ *  Task 2 File System (T2FS) 2019/1                                         *
+ *                                                                           *
+ *  Authors: Yuri Jaschek                                                    *
+ *           Giovane Fonseca                                                 *
+ *           Humberto Lentz                                                  *
+ *           Matheus F. Kovaleski                                            *
+ *                                                                           *
+ *****************************************************************************/
+
+/*
+ *   Pinned metadata: the inodes of opened files and the root directory
+ *       blocks, released only by who pinned them
+ */
+
+#include "apidisk.h"
+#include "apidisk_ext.h"
+#include "libt2fs.h"
+#include "t2fs.h"
+#include "check.h"
+
+#define DISK_SECTORS 8192
+#define NUM_FILES    20
+#define INODES_SECTOR (SECTOR_SIZE / sizeof(struct t2fs_inode))
+
+
+static u32 pinned(void)
+{
+    CACHESTAT2 st;
+    CHECK(t2fs_cache_stats(&st) == 0);
+    return st.pinned_bytes;
+}
+
+
+// Open a file twice: the first time when nothing more can be pinned
+static void check_opened(void)
+{
+    char path[16];
+    for(int i=0; i<NUM_FILES; i++)
+    {
+        sprintf(path, "/f%d", i);
+        FILE2 f = create2(path);
+        CHECK(f >= 0);
+        CHECK(close2(f) == 0);
+    }
+    struct t2fs_path info = get_path_info(path, false);
+    CHECK(info.exists
+          && info.inode / INODES_SECTOR != ROOT_INODE / INODES_SECTOR);
+
+    // Only the root inode and directory fit in the pinned quarter
+    u32 root = pinned();
+    CHECK(cache2_config(4 * root, 0) == 0);
+    FILE2 a = open2(path);
+    CHECK(a >= 0);
+    CHECK(pinned() == root);
+
+    CHECK(cache2_config(256*1024, 0) == 0);
+    FILE2 b = open2(path);
+    CHECK(b >= 0);
+    CHECK(pinned() == root + SECTOR_SIZE);
+    CHECK(close2(a) == 0); // Didn't pin, so doesn't unpin
+    CHECK(pinned() == root + SECTOR_SIZE);
+    CHECK(close2(b) == 0);
+    CHECK(pinned() == root);
+}
+
+
+// Grow the root directory by a block and shrink it back
+static void check_root_blocks(void)
+{
+    struct t2fs_inode before;
+    CHECK(read_inode(ROOT_INODE, &before) == 0);
+    u32 root = pinned();
+    u32 block = allocate_new_block(ROOT_INODE);
+    CHECK(block != 0);
+    CHECK(pinned() == root + superblock.block_size);
+    CHECK(deallocate_blocks(ROOT_INODE, 1) == 0);
+    CHECK(pinned() == root); // Freed, it may be reused for anything
+    CHECK(write_inode(ROOT_INODE, &before) == 0); // Its size
+
+}
+
+
+int main(void)
+{
+    CHECK(ramdisk_create(DISK_SECTORS, 0) == 0);
+    CHECK(format2(4) == 0);
+    check_opened();
+    check_root_blocks();
+    return CHECK_DONE();
+}
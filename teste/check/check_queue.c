@@ -0,0 +1,172 @@
+/*****************************************************************************
+ *  Instituto de Informatica - Universidade Federal do Rio Grande do Sul     *
+ *  INF01142 - Sistemas Operacionais I N                                     *
+ *  Task 2 File System (T2FS) 2019/1                                         *
+ *                                                                           *
+ *  Authors: Yuri Jaschek                                                    *
+ *           Giovane Fonseca                                                 *
+ *           Humberto Lentz                                                  *
+ *           Matheus F. Kovaleski                                            *
+ *                                                                           *
+ *****************************************************************************/
+
+/*
+ *   Sector I/O: multi-sector and vectored transfers, and the write queue,
+ *       which holds writes, shows them to reads, merges adjacent ones and
+ *       keeps the ones that fail
+ */
+
+#include "apidisk.h"
+#include "apidisk_ext.h"
+#include "libt2fs.h"
+#include "check.h"
+#include <string.h>
+
+#define DISK_SECTORS 1024
+
+static const struct disk_ops *ram_ops;
+static u32 bad_sector = DISK_SECTORS; // Writes to it fail (none if outside)
+
+
+static void fill(byte_t *data, u32 count, byte_t c)
+{
+    memset(data, c, count * SECTOR_SIZE);
+}
+
+
+static struct disk_io_stats io_stats(void)
+{
+    struct disk_io_stats st;
+    t2fs_io_stats(&st);
+    return st;
+}
+
+
+static int faulty_write(unsigned int sector, unsigned int count,
+                        unsigned char *buffer)
+{
+    if(bad_sector >= sector && bad_sector < sector + count)
+        return -1;
+    return ram_ops->write(sector, count, buffer);
+}
+
+
+static void check_vectored(void)
+{
+    byte_t a[4 * SECTOR_SIZE], b[4 * SECTOR_SIZE];
+    for(u32 i=0; i<sizeof(a); i++)
+        a[i] = i * 7;
+    CHECK(write_sectors(100, 4, a) == 0);
+    CHECK(read_sectors(100, 4, b) == 0);
+    CHECK(memcmp(a, b, sizeof(a)) == 0);
+
+    // Written in 1 + 2 + 1 sectors, read back in 2 + 2
+    struct iovec wr[3] =
+    {
+        { a + 3 * SECTOR_SIZE, SECTOR_SIZE },
+        { a + SECTOR_SIZE, 2 * SECTOR_SIZE },
+        { a, SECTOR_SIZE },
+    };
+    CHECK(writev_sectors(200, wr, 3) == 0);
+    fill(b, 4, 0);
+    struct iovec rd[2] = { { b, 2 * SECTOR_SIZE }, { b + 2 * SECTOR_SIZE,
+                                                     2 * SECTOR_SIZE } };
+    CHECK(readv_sectors(200, rd, 2) == 0);
+    CHECK(memcmp(b, a + 3 * SECTOR_SIZE, SECTOR_SIZE) == 0);
+    CHECK(memcmp(b + SECTOR_SIZE, a + SECTOR_SIZE, 2 * SECTOR_SIZE) == 0);
+    CHECK(memcmp(b + 3 * SECTOR_SIZE, a, SECTOR_SIZE) == 0);
+}
+
+
+static void check_queue(void)
+{
+    byte_t old[5 * SECTOR_SIZE], data[5 * SECTOR_SIZE], x[SECTOR_SIZE];
+    byte_t a[SECTOR_SIZE], b[SECTOR_SIZE], c[SECTOR_SIZE];
+    fill(old, 5, 'o');
+    fill(x, 1, 'x');
+    fill(a, 1, 'a');
+    fill(b, 1, 'b');
+    fill(c, 1, 'c');
+    CHECK(write_sectors(9, 5, old) == 0);
+
+    // Held, out of order, the last write of a sector replacing the first
+    t2fs_io_stats_reset();
+    CHECK(t2fs_queue_write(12, 1, c) == 0);
+    CHECK(t2fs_queue_write(10, 1, x) == 0);
+    CHECK(t2fs_queue_write(11, 1, b) == 0);
+    CHECK(t2fs_queue_write(10, 1, a) == 0);
+    CHECK(io_stats().write.requests == 0);
+
+    // Reads of pending sectors only don't reach the disk
+    CHECK(t2fs_queue_read(10, 3, data) == 0);
+    CHECK(io_stats().read.requests == 0);
+    CHECK(memcmp(data, a, SECTOR_SIZE) == 0);
+    CHECK(memcmp(data + SECTOR_SIZE, b, SECTOR_SIZE) == 0);
+    CHECK(memcmp(data + 2 * SECTOR_SIZE, c, SECTOR_SIZE) == 0);
+
+    // The disk still has the old data, which the overlay brings up to date
+    CHECK(read_sectors(9, 5, data) == 0);
+    CHECK(memcmp(data, old, sizeof(old)) == 0);
+    CHECK(t2fs_queue_overlay(9, 5, data) == 3);
+    CHECK(memcmp(data, old, SECTOR_SIZE) == 0);
+    CHECK(memcmp(data + SECTOR_SIZE, a, SECTOR_SIZE) == 0);
+    CHECK(memcmp(data + 3 * SECTOR_SIZE, c, SECTOR_SIZE) == 0);
+    CHECK(memcmp(data + 4 * SECTOR_SIZE, old, SECTOR_SIZE) == 0);
+
+    t2fs_queue_cancel(12, 1);
+    CHECK(t2fs_queue_overlay(9, 5, data) == 2);
+    CHECK(t2fs_queue_write(12, 1, c) == 0);
+
+    // The three adjacent sectors are written with a single request
+    t2fs_io_stats_reset();
+    CHECK(t2fs_queue_flush() == 0);
+    CHECK(io_stats().write.requests == 1);
+    CHECK(io_stats().write.sectors == 3);
+    CHECK(t2fs_queue_overlay(9, 5, data) == 0); // Nothing pending
+    CHECK(read_sectors(10, 3, data) == 0);
+    CHECK(memcmp(data, a, SECTOR_SIZE) == 0);
+    CHECK(memcmp(data + SECTOR_SIZE, b, SECTOR_SIZE) == 0);
+    CHECK(memcmp(data + 2 * SECTOR_SIZE, c, SECTOR_SIZE) == 0);
+}
+
+
+// A write that fails stays queued, and is written by the next flush
+static void check_failed(void)
+{
+    struct disk_ops faulty = *ram_ops;
+    faulty.write = faulty_write;
+    faulty.writev = 0; // NULL: the writes go through faulty_write
+    faulty.submit = 0;
+    CHECK(set_disk_ops(&faulty) == 0);
+
+    byte_t a[2 * SECTOR_SIZE], b[SECTOR_SIZE], data[2 * SECTOR_SIZE];
+    fill(a, 2, 'A');
+    fill(b, 1, 'B');
+    CHECK(t2fs_queue_write(20, 2, a) == 0);
+    CHECK(t2fs_queue_write(30, 1, b) == 0);
+    bad_sector = 30;
+    CHECK(t2fs_queue_flush() != 0);
+    CHECK(t2fs_queue_overlay(20, 2, data) == 0); // Written
+    CHECK(read_sectors(20, 2, data) == 0);
+    CHECK(memcmp(data, a, sizeof(a)) == 0);
+    CHECK(t2fs_queue_overlay(30, 1, data) == 1); // Still pending
+    CHECK(memcmp(data, b, SECTOR_SIZE) == 0);
+
+    bad_sector = DISK_SECTORS;
+    CHECK(t2fs_queue_flush() == 0);
+    CHECK(t2fs_queue_overlay(30, 1, data) == 0);
+    CHECK(read_sectors(30, 1, data) == 0);
+    CHECK(memcmp(data, b, SECTOR_SIZE) == 0);
+    CHECK(set_disk_ops(ram_ops) == 0);
+}
+
+
+int main(void)
+{
+    CHECK(ramdisk_create(DISK_SECTORS, 0) == 0);
+    ram_ops = get_disk_ops();
+    check_vectored();
+    check_queue();
+    check_failed();
+    return CHECK_DONE();
+}
@@ -0,0 +1,100 @@
+/*****************************************************************************
+ *  Instituto de Informatica - Universidade Federal do Rio Grande do Sul     *
+ *  INF01142 - Sistemas Operacionais I N                                     *
+ *  Task 2 File System (T2FS) 2019/1                                         *
+ *                                                                           *
+ *  Authors: Yuri Jaschek                                                    *
+ *           Giovane Fonseca                                                 *
+ *           Humberto Lentz                                                  *
+ *           Matheus F. Kovaleski                                            *
+ *                                                                           *
+ *****************************************************************************/
+
+/*
+ *   Simulated devices: the same work takes the same virtual time on every
+ *       run, the warm-up at mount included
+ */
+
+#include "apidisk.h"
+#include "apidisk_ext.h"
+#include "t2fs.h"
+#include "check.h"
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define DISK_SECTORS 8192
+#define NUM_FILES    20
+#define FILE_SIZE    3000
+
+
+// Format, write files, remount and read them back, on the simulated device
+static unsigned long long workload(const struct disk_sim_model *model)
+{
+    if(ramdisk_create(DISK_SECTORS, 0) != 0
+       || disk_sim_start(model, DISK_SECTORS) != 0 || format2(4) != 0)
+        return 0;
+
+    static char buffer[FILE_SIZE];
+    char path[16];
+    for(int i=0; i<NUM_FILES; i++)
+    {
+        sprintf(path, "/f%d", i);
+        memset(buffer, 'a' + i, FILE_SIZE);
+        FILE2 f = create2(path);
+        write2(f, buffer, FILE_SIZE);
+        close2(f);
+    }
+    if(umount2() != 0)
+        return 0;
+    for(int i=0; i<NUM_FILES; i++) // After the warm-up
+    {
+        sprintf(path, "/f%d", i);
+        FILE2 f = open2(path);
+        read2(f, buffer, FILE_SIZE);
+        close2(f);
+        if(i % 2)
+            delete2(path);
+    }
+    if(sync2() != 0)
+        return 0;
+    return disk_sim_time();
+}
+
+
+// Run the workload in a new process, as the disk can only be set up once
+static unsigned long long run(const struct disk_sim_model *model)
+{
+    int fds[2];
+    if(pipe(fds) != 0)
+        return 0;
+    pid_t pid = fork();
+    if(pid == 0)
+    {
+        unsigned long long ns = workload(model);
+        _exit(write(fds[1], &ns, sizeof(ns)) == sizeof(ns) ? 0 : 1);
+    }
+    unsigned long long ns = 0;
+    if(pid < 0 || read(fds[0], &ns, sizeof(ns)) != sizeof(ns))
+        ns = 0;
+    if(pid > 0)
+        waitpid(pid, 0, 0);
+    close(fds[0]);
+    close(fds[1]);
+    return ns;
+}
+
+
+int main(void)
+{
+    unsigned long long hdd = run(&disk_sim_hdd);
+    unsigned long long ssd = run(&disk_sim_ssd);
+    CHECK(hdd != 0 && ssd != 0);
+    CHECK(hdd != ssd);
+    for(int r=0; r<3; r++)
+    {
+        CHECK(run(&disk_sim_hdd) == hdd);
+        CHECK(run(&disk_sim_ssd) == ssd);
+    }
+    return CHECK_DONE();
+}
@@ -244,6 +244,42 @@ DECL_FUNC(FN_ABOUT)
     return 0;
 }
 
+DECL_FUNC(FN_CACHESTAT)
+{
+    if(args.size() != 1)
+        return printUsage(args[0]);
+    static CACHESTAT2 prev; // Counters of the previous call (zero at first)
+    static const char *kinds[CACHE_NUM_KINDS] =
+        {"data", "directory", "index", "inode table", "bitmap"};
+    CACHESTAT2 st;
+    int res = t2fs_cache_stats(&st);
+    if(res != 0)
+        return setError(res, "could not get the cache statistics");
+    if(st.hits < prev.hits) // Counters were reset meanwhile
+        memset(&prev, 0, sizeof(prev));
+    unsigned long long hits = st.hits - prev.hits;
+    unsigned long long misses = st.misses - prev.misses;
+    printf("hits        %llu (%.1f%%)\n", hits,
+           hits+misses ? 100.0 * hits / (hits+misses) : 0.0);
+    printf("misses      %llu (%llu remembered)\n", misses,
+           (unsigned long long)(st.ghost_hits - prev.ghost_hits));
+    printf("evictions   %llu\n",
+           (unsigned long long)(st.evictions - prev.evictions));
+    printf("writebacks  %llu\n",
+           (unsigned long long)(st.writebacks - prev.writebacks));
+    unsigned int bytes = 0;
+    for(int i=0; i<CACHE_NUM_KINDS; i++)
+        bytes += st.kind_bytes[i];
+    printf("entries     %u, %u bytes of %u (%u pinned)\n", st.entries,
+           bytes, st.capacity, st.pinned_bytes);
+    printf("dirty       %u, %u bytes\n", st.dirty, st.dirty_bytes);
+    for(int i=0; i<CACHE_NUM_KINDS; i++)
+        printf("  %-12s%u, %u bytes\n", kinds[i], st.kind_entries[i],
+               st.kind_bytes[i]);
+    prev = st;
+    return 0;
+}
+
 DECL_FUNC(FN_CD)
 {
     if(args.size() != 2)
@@ -424,20 +460,40 @@ DECL_FUNC(FN_CREATE)
     return handle;
 }
 
+DECL_FUNC(FN_DF)
+{
+    if(args.size() != 1)
+        return printUsage(args[0]);
+    STATFS2 st;
+    int res = statfs2(&st);
+    if(res != 0)
+        return setError(res, "could not get the usage of the partition");
+    printf("          %10s %10s %10s\n", "total", "used", "free");
+    printf("blocks    %10u %10u %10u (%u bytes each)\n", st.total_blocks,
+           st.total_blocks - st.free_blocks, st.free_blocks, st.block_size);
+    printf("inodes    %10u %10u %10u\n", st.total_inodes,
+           st.total_inodes - st.free_inodes, st.free_inodes);
+    return 0;
+}
+
 DECL_FUNC(FN_EXIT)
 {
     (void)args;
+    int res = umount2();
+    if(res != 0)
+        return setError(res, "could not write everything to disk");
     return 0;
 }
 
 DECL_FUNC(FN_FORMAT)
 {
-    if(args.size() != 2)
+    bool sparse = args.size() == 3 && args[1] == "-s";
+    if(args.size() != 2 && !sparse)
         return printUsage(args[0]);
     int num_sectors = 0;
-    if(stringToInt(args[1], &num_sectors) != 0)
+    if(stringToInt(args.back(), &num_sectors) != 0)
         return setError(-1, "invalid num_sectors: ");
-    int ans = format2(num_sectors);
+    int ans = sparse ? format2_sparse(num_sectors) : format2(num_sectors);
     if(ans != 0)
         return setError(ans, "could not format t2fs_disk.dat");
     return ans;
@@ -687,6 +743,16 @@ DECL_FUNC(FN_SETVAR)
     return 0;
 }
 
+DECL_FUNC(FN_SYNC)
+{
+    if(args.size() != 1)
+        return printUsage(args[0]);
+    int res = sync2();
+    if(res != 0)
+        return setError(res, "could not write to disk");
+    return 0;
+}
+
 DECL_FUNC(FN_TRUNC)
 {
     if(args.size() != 2)
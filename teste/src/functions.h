@@ -35,12 +35,14 @@
 enum functions // Functions in the terminal
 {
     FN_ABOUT,
+    FN_CACHESTAT,
     FN_CD,
     FN_CLOSE,
     FN_CMD,
     FN_CMP,
     FN_CP,
     FN_CREATE,
+    FN_DF,
     FN_EXIT,
     FN_FORMAT,
     FN_FSCP,
@@ -55,6 +57,7 @@ enum functions // Functions in the terminal
     FN_RMDIR,
     FN_SEEK,
     FN_SETVAR,
+    FN_SYNC,
     FN_TRUNC,
     FN_WHO,
     FN_WRITE,
@@ -62,12 +65,14 @@ enum functions // Functions in the terminal
 
 // Declarations of the terminal functions by its code
 DECL_FUNC(FN_ABOUT);
+DECL_FUNC(FN_CACHESTAT);
 DECL_FUNC(FN_CD);
 DECL_FUNC(FN_CLOSE);
 DECL_FUNC(FN_CMD);
 DECL_FUNC(FN_CMP);
 DECL_FUNC(FN_CP);
 DECL_FUNC(FN_CREATE);
+DECL_FUNC(FN_DF);
 DECL_FUNC(FN_EXIT);
 DECL_FUNC(FN_FORMAT);
 DECL_FUNC(FN_FSCP);
@@ -82,6 +87,7 @@ DECL_FUNC(FN_RM);
 DECL_FUNC(FN_RMDIR);
 DECL_FUNC(FN_SEEK);
 DECL_FUNC(FN_SETVAR);
+DECL_FUNC(FN_SYNC);
 DECL_FUNC(FN_TRUNC);
 DECL_FUNC(FN_WHO);
 DECL_FUNC(FN_WRITE);
@@ -99,6 +105,9 @@ const std::map<int,Function> fn_lst =
 {
     ADD_TO_MAP(FN_ABOUT,  "%s",
                           "Display information about this shell"),
+    ADD_TO_MAP(FN_CACHESTAT, "%s",
+                          "Display statistics of the T2FS cache\n" \
+                          "Counters are the ones since the previous call, then what the cache holds now"),
     ADD_TO_MAP(FN_CD,     "%s directory",
                           "Change the current working directory\n"),
     ADD_TO_MAP(FN_CLOSE,  "%s handle",
@@ -111,10 +120,13 @@ const std::map<int,Function> fn_lst =
                           "Copy a file from source to destiny"),
     ADD_TO_MAP(FN_CREATE, "%s file",
                           "Create a new file"),
+    ADD_TO_MAP(FN_DF,     "%s",
+                          "Display the used and free blocks and inodes of the partition"),
     ADD_TO_MAP(FN_EXIT,   "%s",
-                          "Exit this shell"),
-    ADD_TO_MAP(FN_FORMAT, "%s number",
+                          "Write everything to disk and exit this shell"),
+    ADD_TO_MAP(FN_FORMAT, "%s [-s] number",
                           "Format the partition 0 using number sectors per block\n" \
+                          "-s makes \"t2fs_disk.dat\" sparse, freeing its unused space on the host\n" \
                           "Note that \"t2fs_disk.dat\" must be in the same directory as this shell"),
     ADD_TO_MAP(FN_FSCP,   "%s {-f | -t} file1 file2",
                           "Copy a file between filesystems\n" \
@@ -145,6 +157,8 @@ const std::map<int,Function> fn_lst =
     ADD_TO_MAP(FN_SETVAR, "%s variable",
                           "Set the variable to the value returned by the previous command\n" \
                           "To refer to a variable set, use a dollar sign before its name"),
+    ADD_TO_MAP(FN_SYNC,   "%s",
+                          "Write to disk all data still in memory"),
     ADD_TO_MAP(FN_TRUNC,  "%s handle",
                           "Truncate an opened file at its current pointer, given its handle\n" \
                           "Truncation deletes all data from (and including) the current pointer"),
@@ -160,12 +174,14 @@ const std::map<int,Function> fn_lst =
 const std::map<std::string,int> cmd_lst =
 {
     {"about", FN_ABOUT},
+    {"cachestat", FN_CACHESTAT},
     {"cd", FN_CD}, {"chdir", FN_CD},
     {"close", FN_CLOSE},
     {"cmd", FN_CMD},
     {"cmp", FN_CMP}, {"diff", FN_CMP},
     {"cp", FN_CP}, {"copy", FN_CP},
     {"create", FN_CREATE},
+    {"df", FN_DF},
     {"exit", FN_EXIT}, {"quit", FN_EXIT}, {"q", FN_EXIT},
     {"format", FN_FORMAT}, {"fmt", FN_FORMAT},
     {"fscp", FN_FSCP},
@@ -180,6 +196,7 @@ const std::map<std::string,int> cmd_lst =
     {"rmdir", FN_RMDIR},
     {"seek", FN_SEEK},
     {"setvar", FN_SETVAR},
+    {"sync", FN_SYNC},
     {"trunc", FN_TRUNC},
     {"who", FN_WHO}, {"id", FN_WHO},
     {"write", FN_WRITE},